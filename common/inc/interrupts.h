@@ -9,6 +9,8 @@
 #include "stdint.h"
 #include "stddef.h"
 
+#define MAX_CPU_COUNT (64)
+
 void pic_fini(void);
 
 void gdt_init(void);
@@ -23,12 +25,35 @@ void acpi_intr_init(void);
 
 typedef void (*InterruptHandler)(int);
 
+typedef void (*DeferredWork)(void *arg);
+
+// Given the frame an interrupt is about to return to, returns the frame to
+// resume instead. Returning another frame switches to the stack it lives on.
+typedef void *(*InterruptSwitch)(void *frame);
+
+// Masks or unmasks the source of irq
+typedef void (*InterruptMask)(int irq, bool mask);
+
+// Reprograms the hardware delivering irq to the given apic id
+typedef void (*InterruptRetarget)(int irq, int apic_id);
+
 typedef enum {
     interrupt_flags_none = 0,
     interrupt_flags_exclusive = (1 << 0),
     interrupt_flags_fixed = (1 << 1),
+    interrupt_flags_timer = (1 << 2),   // allocate from the timer class
+    interrupt_flags_ipi = (1 << 3),     // allocate from the IPI class
 } interrupt_flags_t;
 
+// Priority classes, raising to a class masks it and every class below it.
+// Vectors are allocated from the matching range, device vectors by default.
+typedef enum {
+    interrupt_priority_none = 0x0,
+    interrupt_priority_device = 0x8,    // 0x20 - 0x8F
+    interrupt_priority_timer = 0xE,     // 0xE0 - 0xEF
+    interrupt_priority_ipi = 0xF,       // 0xF0 - 0xFE
+} interrupt_priority_t;
+
 typedef enum {
     ipi_delivery_mode_fixed = 0,
     ipi_delivery_mode_init = 5,
@@ -68,28 +93,146 @@ struct interrupt_register_state {
 
 void interrupt_sendeoi(int irq);
 
+// Mask vectors up to and including prio on the calling core, returns the
+// previous level for interrupt_lowerpriority. Never lowers the current level.
+// Locks taken at a raised level must not be taken by handlers above it.
+int interrupt_raisepriority(interrupt_priority_t prio);
+
+void interrupt_lowerpriority(int prev);
+
 void interrupt_registerhandler(int irq, InterruptHandler handler);
 
 void interrupt_unregisterhandler(int irq, InterruptHandler handler);
 
 int interrupt_allocate(int cnt, interrupt_flags_t flags, int *base);
 
+// Return exclusive vectors from interrupt_allocate, their handlers must
+// already be unregistered.
+void interrupt_free(int base, int cnt);
+
+// Allocate cnt consecutive vectors in the given core's own vector space, from
+// the priority class selected by flags.
+int interrupt_allocate_local(int cpunum, int cnt, interrupt_flags_t flags,
+                             int *base);
+
+// Return vectors from interrupt_allocate_local, their handlers must already
+// be unregistered.
+void interrupt_free_local(int cpunum, int base, int cnt);
+
+void interrupt_registerhandler_local(int cpunum, int irq, InterruptHandler handler);
+
+void interrupt_unregisterhandler_local(int cpunum, int irq, InterruptHandler handler);
+
+// Wait for every other core to leave the dispatch it was in when called, a
+// handler unregistered before this can no longer be running anywhere.
+void interrupt_quiesce(void);
+
 void interrupt_mapinterrupt(uint32_t line, int irq, bool active_low, bool level_trig);
 
 int interrupt_get_cpuidx(void);
 
+// Dense core index in [0, MAX_CPU_COUNT), assigned in bring-up order.
+int interrupt_get_cpunum(void);
+
+int interrupt_get_apicid(int cpunum);
+
+// Number of times irq has been dispatched on the given core.
+uint64_t interrupt_getcount(int cpunum, int irq);
+
+// Print per-vector dispatch counts by core and log2 handler duration histograms.
+void interrupt_dumpstats(void);
+
+// Mark the calling core as accepting device interrupts.
+void interrupt_setcpuonline(void);
+
+// Restrict irq to the cores in mask (bit n is cpunum n), 0 allows every core.
+int interrupt_setaffinity(int irq, uint64_t mask);
+
+uint64_t interrupt_getaffinity(int irq);
+
+// Cores that have called interrupt_setcpuonline.
+uint64_t interrupt_getonlinemask(void);
+
+// Apic id that device interrupts for irq should be sent to.
+int interrupt_gettarget(int irq);
+
+void interrupt_setretarget(int irq, InterruptRetarget retarget);
+
+// Redistribute retargetable irqs across cores by their rate since the last call.
+void interrupt_balance(void);
+
+// Run interrupt_balance periodically from the calling core, once the APs are up.
+void interrupt_balance_init(void);
+
 void interrupt_setmask(uint32_t line, bool mask);
 
+// Mask every IOAPIC line routed to irq.
+void interrupt_setvectormask(int irq, bool mask);
+
 void interrupt_sendipi(int cpu, int vector, ipi_delivery_mode_t delivery_mode);
 
+// Send a fixed IPI to every core in mask (bit n is cpunum n), batching
+// destinations with the all-but-self shorthand or x2apic clusters.
+void interrupt_sendipi_mask(uint64_t mask, int vector);
+
 void interrupt_setstack(void *stack);
 
 void interrupt_setregisterstate(interrupt_register_state_t *state);
 
 void interrupt_getregisterstate(interrupt_register_state_t *state);
 
+// Build a frame just below stack that resumes state once an InterruptSwitch
+// returns it.
+void *interrupt_buildframe(void *stack, interrupt_register_state_t *state);
+
+// Called on the way out of the outermost interrupt when the interrupted code
+// had interrupts enabled. done runs with interrupts disabled on the new stack
+// after a switch, once the old one is no longer in use.
+void interrupt_setswitch(InterruptSwitch pick, void (*done)(void));
+
 uint32_t msi_register_addr(int cpu_idx);
 
 uint64_t msi_register_data(int vec);
 
+// Queue work on the calling core, it runs with interrupts enabled on the way
+// out of the current interrupt or from the idle loop. Fails if the ring is full.
+int interrupt_defer(DeferredWork func, void *arg);
+
+// Drain the calling core's deferred work, returns true if work is still pending.
+bool interrupt_rundeferred(void);
+
+// Start the calling core's deferred work thread, woken when an interrupt exit
+// leaves work behind. Needs the core's scheduler to be up.
+void interrupt_deferred_startworker(void);
+
+// Print per-core deferred work counts and raise-to-run latency in cycles.
+void interrupt_dumpdeferred(void);
+
+// Register a handler whose body runs in its own kernel thread at the given
+// thread priority (0 is the highest). The hard irq runs quick (may be NULL),
+// masks the source through mask (IOAPIC lines if NULL) and wakes the thread,
+// which unmasks once thread returns. Any core may run the thread.
+int interrupt_registerthreaded(int irq, InterruptHandler quick, InterruptHandler thread,
+                               InterruptMask mask, int priority);
+
+// Stops the handler thread once it finishes any pending run.
+void interrupt_unregisterthreaded(int irq);
+
+// Idle loop body, runs deferred work then halts until the next interrupt.
+void interrupt_idle(void);
+
+// Keep the next interrupt_idle on cpunum from halting. Pair with an IPI to
+// wake a core that is already halted.
+void interrupt_wakeidle(int cpunum);
+
+#ifdef BENCHMARK
+void interrupt_benchmark(void);
+
+void interrupt_benchmark_ap(void);
+
+void interrupt_deferred_benchmark(void);
+
+void interrupt_priority_benchmark(void);
+#endif
+
 #endif
\ No newline at end of file
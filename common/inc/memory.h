@@ -32,8 +32,14 @@ typedef enum {
     vmem_err_alreadymapped = -1,
     vmem_err_continue = -2,
     vmem_err_nomapping = -3,
+    vmem_err_overflow = -4,
 } vmem_errs;
 
+typedef struct {
+    intptr_t phys;
+    size_t len;
+} vmem_physrun_t;
+
 void tls_init(void);
 
 TLS void* tls_alloc(size_t sz);
@@ -66,10 +72,24 @@ int vmem_flush(intptr_t virt, size_t sz);
 
 int vmem_virttophys(intptr_t virt, intptr_t *phys);
 
+// Translate [virt, virt + sz) into physically contiguous runs.
+// Returns the number of runs written, or vmem_err_overflow if max_runs is too small.
+int vmem_virttophys_range(intptr_t virt, size_t sz, vmem_physrun_t *runs, int max_runs);
+
 intptr_t vmem_phystovirt(intptr_t phys, size_t sz, int flags);
 
+// Returns the write-combining mapping of the bootloader framebuffer, 0 if absent.
+intptr_t vmem_getframebuffer(void);
+
+// Print page table memory use and per level table/entry counts, NULL for the kernel map.
+void vmem_dumpstats(vmem_t *vm);
+
 intptr_t vmem_vmalloc(size_t sz);
 
 void vmem_vfree(intptr_t virt, size_t sz);
 
+#ifdef BENCHMARK
+void vmem_fb_benchmark(void);
+#endif
+
 #endif
\ No newline at end of file
@@ -6,6 +6,7 @@
 #ifndef GUBERNATRIX_PCI_H
 #define GUBERNATRIX_PCI_H
 
+#include "interrupts.h"
 #include "memory.h"
 #include "stddef.h"
 #include "stdint.h"
@@ -125,4 +126,13 @@ int pci_getmsiinfo(pci_config_t *device, int *cnt);
 int pci_setmsiinfo(pci_config_t *device, int msix, uintptr_t *msi_addr,
                    uint32_t *msi_msg, int cnt);
 
+// Allocate cnt MSI-X vectors spread round robin over the online cores in
+// cpu_mask (0 for all of them) and route each table entry to its core.
+// vectors[i] and cpus[i] receive the vector and core of entry i. On failure
+// the device and the vector spaces are left untouched.
+int pci_msix_allocate(pci_config_t *device, int cnt, uint64_t cpu_mask,
+                      InterruptHandler handler, int *vectors, int *cpus);
+
+int pci_msix_setmask(pci_config_t *device, int entry, bool mask);
+
 #endif
\ No newline at end of file
@@ -1,8 +1,11 @@
 // Copyright (c) 2019 Himanshu Goel
-// 
+//
 // This software is released under the MIT License.
 // https://opensource.org/licenses/MIT
 
+#ifndef GUBERNATRIX_THREAD_H
+#define GUBERNATRIX_THREAD_H
+
 #include "stdint.h"
 #include "stddef.h"
 #include "types.h"
@@ -10,8 +13,78 @@
 #include "memory.h"
 #include "interrupts.h"
 
-typedef struct {
+#define THREAD_PRIO_COUNT (32)
+#define THREAD_PRIO_DEFAULT (16)    // 0 is the highest priority
+
+typedef enum {
+    thread_state_ready,
+    thread_state_running,
+    thread_state_blocked,
+    thread_state_dead,
+} thread_state_t;
+
+typedef struct thread {
     char name[256];
     void *kern_stack_top;
-    interrupt_register_state_t registers;
-} thread_t;
\ No newline at end of file
+    interrupt_register_state_t registers;   // state the thread starts in
+
+    struct thread *next;    // run queue link
+    void *frame;            // saved interrupt frame while switched out
+    void (*entry)(void *);
+    void *arg;
+    int prio;
+    int cpu;
+    bool bound;             // never stolen off the core it was created on
+    thread_state_t state;
+    bool wakeup;            // woken while not blocked, the next block returns at once
+    int level;              // interrupt priority level while switched out
+
+    void *fpu_state;        // allocated on first FPU use
+    int fpu_cpu;            // core whose registers last held fpu_state
+    bool fpu_used;          // touched the FPU since it was switched in
+} thread_t;
+
+// Create a kernel thread and queue it on the calling core, idle cores steal it
+// from there. Returns NULL on allocation failure.
+thread_t *thread_create(const char *name, void (*entry)(void *), void *arg, int prio);
+
+// Same as thread_create, but the thread only ever runs on the calling core.
+thread_t *thread_create_local(const char *name, void (*entry)(void *), void *arg, int prio);
+
+thread_t *thread_current(void);
+
+// Give up the core to the next ready thread of the same or higher priority.
+void thread_yield(void);
+
+void thread_exit(void);
+
+// Take the calling thread off its core until thread_wake. Returns at once if
+// a wakeup arrived since the last block. Returns -1 without blocking from the
+// idle loop, with interrupts disabled or preemption disabled, or at a raised
+// priority level. Callers recheck their condition either way.
+int thread_block(void);
+
+// Make a blocked thread ready again, callable from any core and from
+// interrupt handlers.
+void thread_wake(thread_t *t);
+
+// Keep the calling thread on its core, nests. Interrupts still run but no
+// switch happens on their way out until the matching preempt_enable, which
+// takes any switch that was held off.
+void preempt_disable(void);
+void preempt_enable(void);
+
+void thread_init(void);
+void thread_mp_init(void);
+
+// Run threads on the calling core forever, stealing from the busiest core
+// when there is nothing local.
+void thread_idle(void);
+
+#ifdef BENCHMARK
+void thread_benchmark(void);
+
+void thread_switch_benchmark(void);
+#endif
+
+#endif
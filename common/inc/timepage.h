@@ -0,0 +1,83 @@
+// Copyright (c) 2019 Himanshu Goel
+//
+// This software is released under the MIT License.
+// https://opensource.org/licenses/MIT
+
+#ifndef GUBERNATRIX_TIMEPAGE_H
+#define GUBERNATRIX_TIMEPAGE_H
+
+#include "stdint.h"
+
+// Read-only page mapped into every address space, lets clocks be read
+// without entering the kernel.
+#define TIME_PAGE_ADDR (0x00007FFFFFFFF000)
+
+typedef enum {
+  time_page_mode_none = 0, // clock can't be read directly, use the kernel
+  time_page_mode_tsc = 1,
+} time_page_mode_t;
+
+// seq is odd while the kernel is updating the page
+typedef struct {
+  uint32_t seq;
+  uint32_t mode;
+  uint64_t mult; // ns = base_ns + (((tsc - base_cnt) * mult) >> shift)
+  uint32_t shift;
+  uint64_t base_cnt;
+  uint64_t base_ns;
+  uint64_t realtime_ns; // realtime = monotonic + realtime_ns
+} time_page_t;
+
+// Copy out a consistent snapshot, returns false if the page has no direct
+// clock and the caller has to ask the kernel.
+static inline bool timepage_snapshot(const volatile time_page_t *tp,
+                                     time_page_t *out) {
+  uint32_t seq;
+  do {
+    while ((seq = __atomic_load_n(&tp->seq, __ATOMIC_ACQUIRE)) & 1)
+      __asm__ volatile("pause");
+
+    out->mode = tp->mode;
+    out->mult = tp->mult;
+    out->shift = tp->shift;
+    out->base_cnt = tp->base_cnt;
+    out->base_ns = tp->base_ns;
+    out->realtime_ns = tp->realtime_ns;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&tp->seq, __ATOMIC_RELAXED) != seq);
+
+  return out->mode == time_page_mode_tsc;
+}
+
+static inline uint64_t timepage_scale(const time_page_t *snap) {
+  uint32_t lo, hi;
+  __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+  uint64_t cnt = ((uint64_t)hi << 32) | lo;
+
+  unsigned __int128 delta =
+      (unsigned __int128)(cnt - snap->base_cnt) * snap->mult;
+  return snap->base_ns + (uint64_t)(delta >> snap->shift);
+}
+
+static inline bool timepage_monotonic_ns(const volatile time_page_t *tp,
+                                         uint64_t *ns) {
+  time_page_t snap;
+  if (!timepage_snapshot(tp, &snap))
+    return false;
+
+  *ns = timepage_scale(&snap);
+  return true;
+}
+
+static inline bool timepage_realtime_ns(const volatile time_page_t *tp,
+                                        uint64_t *ns) {
+  time_page_t snap;
+  if (!timepage_snapshot(tp, &snap))
+    return false;
+
+  *ns = timepage_scale(&snap) + snap.realtime_ns;
+  return true;
+}
+
+#endif
@@ -21,6 +21,7 @@ typedef enum {
   timer_features_pcie_msg_intr = (1 << 8),
   timer_features_fixed_intr = (1 << 9),
   timer_features_counter = (1 << 10),
+  timer_features_stable = (1 << 11), // constant rate, agrees across cores
 } timer_features_t;
 
 typedef struct timer_handlers timer_handlers_t;
@@ -35,7 +36,62 @@ struct timer_handlers {
   uint64_t state;
 };
 
-void timer_wait(uint64_t ns);
+typedef struct soft_timer soft_timer_t;
+typedef void (*SoftTimerHandler)(soft_timer_t *, void *);
+
+// Software timer multiplexed onto the local timer tick, storage is owned by
+// the caller and must stay valid while the timer is armed.
+struct soft_timer {
+  soft_timer_t *next;
+  soft_timer_t *prev;
+  uint64_t expires; // tick the timer fires on
+  int cpu;          // wheel the timer is queued on, -1 when idle
+  int slot;
+  SoftTimerHandler func;
+  void *arg;
+};
+
+// Busy-wait on the clocksource, safe with interrupts disabled.
+void ndelay(uint64_t ns);
+void udelay(uint64_t us);
+
+// Block the calling thread until ns have passed, through a one-shot timer on
+// its core's wheel. The idle loop halts instead. Short waits, and waits with
+// interrupts disabled, spin.
+void timer_sleep(uint64_t ns);
+void msleep(uint64_t ms);
+
+// Nanoseconds since the clocksource was selected at boot, never goes back.
+uint64_t clock_monotonic_ns(void);
+
+// Nanoseconds since the epoch, from the RTC read at boot plus the monotonic
+// clock. Kept in step with the RTC once a second.
+uint64_t clock_realtime_ns(void);
+
+// Read the RTC calendar again and step the realtime clock to it.
+void rtc_resync(void);
+
+// Physical address of the read-only time page, see timepage.h.
+intptr_t timepage_getphys(void);
+
+// Name of the counter backing clock_monotonic_ns.
+const char *clock_getsource(void);
+
+void timer_setup(soft_timer_t *t, SoftTimerHandler func, void *arg);
+
+// (Re)arm t on the calling core to fire ns from now. It may be delayed by up
+// to slack_ns so it can share an expiry with nearby timers. The handler runs
+// as deferred work with interrupts enabled.
+void timer_arm(soft_timer_t *t, uint64_t ns, uint64_t slack_ns);
+
+// Returns false if t was not armed or its handler has already been started.
+bool timer_cancel(soft_timer_t *t);
+
+bool timer_pending(soft_timer_t *t);
+
+// Switch the calling core between a fixed tick and programming only the next
+// deadline, through TSC deadline mode when available and APIC one-shot if not.
+void timer_settickless(bool tickless);
 
 int timer_request(timer_features_t features, uint64_t ns, void (*handler)(int));
 int timer_register(timer_features_t features, timer_handlers_t *handlers);
@@ -46,4 +102,21 @@ int timer_platform_init();
 void timer_init(void);
 void timer_mp_init(void);
 
+// Boot time TSC synchronization, the BSP side runs once for all the APs in
+// cpus after they have reached tsc_sync_ap.
+void tsc_sync_bsp(uint64_t cpus);
+void tsc_sync_ap(void);
+
+#ifdef BENCHMARK
+void timer_wheel_benchmark(void);
+
+void timer_tickless_benchmark(void);
+
+void clock_benchmark(void);
+
+void timepage_benchmark(void);
+
+void rtc_benchmark(void);
+#endif
+
 #endif
\ No newline at end of file
@@ -58,6 +58,12 @@ __attribute__((always_inline)) static __inline uint64_t rdmsr(uint32_t msr) {
     return ((uint64_t)hi << 32) | lo;
 }
 
+__attribute__((always_inline)) static __inline uint64_t rdtsc(void) {
+    uint32_t lo = 0, hi = 0;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 __attribute__((always_inline)) static __inline void halt(void) {
     __asm__ volatile("hlt");
 }
@@ -15,7 +15,11 @@ extern "C" {
 
 //! The physical memory regions
 typedef enum {
-  MemoryRegionType_Free = 1, //!< The region is free
+  MemoryRegionType_Free = 1,            //!< The region is free
+  MemoryRegionType_Reserved = 2,        //!< The region is reserved
+  MemoryRegionType_ACPIReclaimable = 3, //!< The region holds ACPI tables
+  MemoryRegionType_ACPINVS = 4,         //!< The region is ACPI NVS memory
+  MemoryRegionType_BadRAM = 5,          //!< The region is defective
 } MemoryRegionType;
 
 //! An entry in the memory map
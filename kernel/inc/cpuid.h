@@ -17,11 +17,15 @@ typedef struct {
     uint64_t tsc_valid : 1;
     uint64_t tsc_deadline : 1;
     uint64_t tsc_invar : 1;
+    uint64_t tsc_adjust : 1;
+    uint64_t xsaveopt : 1;
+    uint64_t xsaves : 1;
     char processor_name[12];
     uint64_t tsc_freq;
     uint64_t apic_freq;
     uint64_t xsave_bits;
     uint32_t xsave_sz;
+    uint32_t xsaves_sz;     // compacted format size for xsave_bits
 } cpuinfo_t;
 
 void cpuid_init(void);
@@ -6,6 +6,8 @@
 #ifndef GUBERNATRIX_SYSFP_H
 #define GUBERNATRIX_SYSFP_H
 
+#include "stdint.h"
+
 void fp_platform_init(void);
 
 int fp_platform_getstatesize(void);
@@ -18,4 +20,8 @@ void fp_platform_setstate(void *buf);
 
 void fp_platform_getdefaultstate(void *buf);
 
+// Make the next FPU use on the calling core trap with #NM (vector 7), for
+// loading state lazily.
+void fp_platform_settrap(bool trap);
+
 #endif
\ No newline at end of file
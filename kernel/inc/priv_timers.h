@@ -7,17 +7,55 @@
 #define GUBERNATRIX_PRIV_TIMERS_H
 
 #include "stddef.h"
+#include "timepage.h"
+#include "timer.h"
+
+#define APIC_TIMER_RATE (20000) // 0.05ms ticks
+#define TIMER_TICK_NEVER (~0ull)
 
 PRIVATE int hpet_getcount();
 
 PRIVATE int hpet_init();
+PRIVATE int hpet_comparators_init(bool percpu);
+PRIVATE uint64_t hpet_getrate();
+PRIVATE uint64_t hpet_readcounter();
+PRIVATE int hpet_clockevent_claim(void (*handler)(int));
+PRIVATE void hpet_clockevent_program(int idx, uint64_t cnt);
 PRIVATE int pit_init();
 PRIVATE int rtc_init();
 PRIVATE int apic_timer_init();
-PRIVATE int apic_timer_tsc_init();
 
 PRIVATE bool use_tsc();
 PRIVATE int tsc_init();
 PRIVATE int tsc_mp_init();
+PRIVATE int tsc_calibrate();
+
+PRIVATE uint64_t hpet_calibrate_tsc(uint32_t ms);
+PRIVATE uint64_t pit_calibrate(uint32_t ms, uint64_t (*read)(void));
+PRIVATE uint64_t pit_calibrate_tsc(uint32_t ms);
+
+PRIVATE int timer_getcounter(int idx, timer_features_t *features,
+                             timer_handlers_t **handlers);
+PRIVATE void timer_clearfeatures(int idx, timer_features_t features);
+PRIVATE void clocksource_select();
+PRIVATE void clocksource_unstable(const char *name);
+PRIVATE void clocksource_publish();
+PRIVATE uint64_t clock_getrealtime(void);
+PRIVATE void clock_setrealtime(uint64_t offset);
+
+PRIVATE uint64_t tsc_local(void);
+
+PRIVATE void timepage_init();
+PRIVATE void timepage_setclock(time_page_mode_t mode, uint64_t mult,
+                               uint32_t shift, uint64_t base_cnt,
+                               uint64_t base_ns);
+PRIVATE void timepage_setrealtime(uint64_t realtime_ns);
+
+PRIVATE uint64_t apic_timer_now(void);
+PRIVATE void apic_timer_rearm(uint64_t tick);
+
+void timer_wheel_init(uint64_t now);
+void timer_wheel_advance(uint64_t target);
+uint64_t timer_wheel_next(void);
 
 #endif
\ No newline at end of file
@@ -21,4 +21,23 @@ void smp_platform_setstate(void* buf);
 void smp_platform_getdefaultstate(void *buf, void *stackpointer, void *instr_ptr, void *args);
 
 void smp_signalready(void);
+
+// Called by each AP once it can serve the BSP, parks the core for good if the
+// BSP already gave up waiting on it.
+void smp_checkin(void);
+
+void smp_call_init(void);
+
+// Run func(arg) on every online core in mask (bit n is cpunum n), waiting for
+// all of them to finish if wait is set. The calling core runs it directly.
+void smp_call_function_mask(uint64_t mask, void (*func)(void*), void *arg, bool wait);
+
+void smp_call_function_single(int cpu, void (*func)(void*), void *arg, bool wait);
+
+// Run func(arg) on every other online core.
+void smp_call_function(void (*func)(void*), void *arg, bool wait);
+
+#ifdef BENCHMARK
+void smp_call_benchmark(void);
+#endif
 #endif
\ No newline at end of file
@@ -130,6 +130,7 @@ void cpuid_init(void) {
     CPUID_RequestInfo(7, 0, &eax, &ebx, &ecx, &edx);
     cpuinfo.smep = (ebx >> 7) & 1;
     cpuinfo.smap = (ebx >> 20) & 1;
+    cpuinfo.tsc_adjust = (ebx >> 1) & 1;
   }
 
   {
@@ -149,6 +150,25 @@ void cpuid_init(void) {
     cpuinfo.xsave_bits = (uint64_t)edx << 32 | eax;
   }
 
+  if (cpuinfo.xsave) {
+    CPUID_RequestInfo(0x0d, 1, &eax, &ebx, &ecx, &edx);
+    cpuinfo.xsaveopt = eax & 1;
+    cpuinfo.xsaves = (eax >> 3) & 1;
+
+    // The compacted format packs the enabled components after the legacy
+    // area and header, some aligned to 64 bytes
+    uint32_t sz = 576;
+    for (int i = 2; i < 64; i++) {
+      if (!(cpuinfo.xsave_bits & (1ull << i)))
+        continue;
+      CPUID_RequestInfo(0x0d, i, &eax, &ebx, &ecx, &edx);
+      if (ecx & 2)
+        sz = (sz + 63) & ~63u;
+      sz += eax;
+    }
+    cpuinfo.xsaves_sz = sz;
+  }
+
   {
     CPUID_RequestInfo(0x80000007, 0, &eax, &ebx, &ecx, &edx);
     cpuinfo.tsc_invar = (edx >> 8) & 1;
@@ -11,6 +11,8 @@
 #include "fpu.h"
 
 static bool xsave = false;
+static bool xsaveopt = false;
+static bool xsaves = false;
 static uint64_t xsave_bits = 0;
 static uint64_t xsave_sz = 0;
 void fp_platform_init(void) {
@@ -20,6 +22,13 @@ void fp_platform_init(void) {
   xsave_bits = get_cpuid()->xsave_bits;
   xsave_sz = get_cpuid()->xsave_sz;
 
+  // Compacted saves that skip components in their init state or unmodified
+  // since the last restore, else the same skipping in the standard format
+  xsaves = xsave && get_cpuid()->xsaves;
+  xsaveopt = xsave && get_cpuid()->xsaveopt;
+  if (xsaves)
+    xsave_sz = get_cpuid()->xsaves_sz;
+
   // Enable FPU
   uint64_t cr0 = 0;
   __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
@@ -57,19 +66,23 @@ int fp_platform_getalign(void) {
 }
 
 void fp_platform_getstate(void *buf) {
-  if (xsave)
-    __asm__ volatile("xsaveq (%0)" ::"r"(buf), "d"(0xffffffffffffffff),
-                     "a"(0xffffffffffffffff)
-                     : "memory");
+  uint32_t lo = (uint32_t)xsave_bits, hi = (uint32_t)(xsave_bits >> 32);
+  if (xsaves)
+    __asm__ volatile("xsaves64 (%0)" ::"r"(buf), "d"(hi), "a"(lo) : "memory");
+  else if (xsaveopt)
+    __asm__ volatile("xsaveoptq (%0)" ::"r"(buf), "d"(hi), "a"(lo) : "memory");
+  else if (xsave)
+    __asm__ volatile("xsaveq (%0)" ::"r"(buf), "d"(hi), "a"(lo) : "memory");
   else
     __asm__ volatile("fxsaveq (%0)" ::"r"(buf) : "memory");
 }
 
 void fp_platform_setstate(void *buf) {
-  if (xsave)
-    __asm__ volatile("xrstorq (%0)" ::"r"(buf), "d"(0xffffffffffffffff),
-                     "a"(0xffffffffffffffff)
-                     : "memory");
+  uint32_t lo = (uint32_t)xsave_bits, hi = (uint32_t)(xsave_bits >> 32);
+  if (xsaves)
+    __asm__ volatile("xrstors64 (%0)" ::"r"(buf), "d"(hi), "a"(lo) : "memory");
+  else if (xsave)
+    __asm__ volatile("xrstorq (%0)" ::"r"(buf), "d"(hi), "a"(lo) : "memory");
   else
     __asm__ volatile("fxrstorq (%0)" ::"r"(buf) : "memory");
 }
@@ -77,10 +90,31 @@ void fp_platform_setstate(void *buf) {
 void fp_platform_getdefaultstate(void *buf) {
   // FPU ctrl word = 0x33F
   // MXCSR = 0x1f80
-
   memset(buf, 0, fp_platform_getstatesize());
 
   uint16_t *buf_u16 = (uint16_t *)buf;
   buf_u16[0] = 0x33f;
   buf_u16[12] = 0x1f80;
-}
\ No newline at end of file
+
+  // Load x87 and SSE from the legacy area, everything else starts in its
+  // init state. Compacted restores also need the format bit.
+  if (xsave) {
+    uint64_t *hdr = (uint64_t *)((uint8_t *)buf + 512);
+    hdr[0] = 3;
+    if (xsaves)
+      hdr[1] = (1ull << 63) | xsave_bits;
+  }
+}
+
+// With TS set the next FPU/SSE instruction raises #NM
+void fp_platform_settrap(bool trap) {
+  if (!trap) {
+    __asm__ volatile("clts");
+    return;
+  }
+
+  uint64_t cr0 = 0;
+  __asm__ volatile("mov %%cr0, %0" : "=r"(cr0));
+  cr0 |= (1 << 3);
+  __asm__ volatile("mov %0, %%cr0" ::"r"(cr0));
+}
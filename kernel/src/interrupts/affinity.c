@@ -0,0 +1,146 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "types.h"
+
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "timer.h"
+
+#define IDT_ENTRY_COUNT (256)
+#define BALANCE_PERIOD_NS (1000ull * 1000 * 1000)
+#define BALANCE_SLACK_NS (100ull * 1000 * 1000)
+
+typedef struct {
+  uint64_t mask; // allowed cores by cpunum, 0 allows every core
+  int target;    // cpunum currently receiving the vector
+  InterruptRetarget retarget;
+  uint64_t last_cnt; // dispatch count at the previous balance pass
+} irq_route_t;
+
+static irq_route_t routes[IDT_ENTRY_COUNT];
+static _Atomic uint64_t online_mask = 0;
+static int route_lock = 0;
+static soft_timer_t balance_timer;
+
+static uint64_t interrupt_allowed(int irq) {
+  uint64_t mask = routes[irq].mask;
+  if (mask == 0)
+    mask = ~0ull;
+  return mask & online_mask;
+}
+
+static void interrupt_moveto(int irq, int cpunum) {
+  if (routes[irq].target == cpunum)
+    return;
+
+  routes[irq].target = cpunum;
+  if (routes[irq].retarget != NULL)
+    routes[irq].retarget(irq, interrupt_get_apicid(cpunum));
+}
+
+void interrupt_setcpuonline(void) {
+  online_mask |= (1ull << interrupt_get_cpunum());
+}
+
+uint64_t interrupt_getonlinemask(void) { return online_mask; }
+
+int interrupt_gettarget(int irq) {
+  return interrupt_get_apicid(routes[irq].target);
+}
+
+uint64_t interrupt_getaffinity(int irq) { return routes[irq].mask; }
+
+int interrupt_setaffinity(int irq, uint64_t mask) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&route_lock);
+
+  routes[irq].mask = mask;
+  uint64_t allowed = interrupt_allowed(irq);
+  if (allowed == 0) {
+    local_spinlock_unlock(&route_lock);
+    interrupt_lowerpriority(prio);
+    return -1;
+  }
+
+  if (~allowed & (1ull << routes[irq].target))
+    interrupt_moveto(irq, __builtin_ctzll(allowed));
+
+  local_spinlock_unlock(&route_lock);
+  interrupt_lowerpriority(prio);
+  return 0;
+}
+
+void interrupt_setretarget(int irq, InterruptRetarget retarget) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&route_lock);
+  routes[irq].retarget = retarget;
+  local_spinlock_unlock(&route_lock);
+  interrupt_lowerpriority(prio);
+}
+
+// Spread the movable vectors over their allowed cores, heaviest first, each
+// going to the least loaded core seen so far.
+void interrupt_balance(void) {
+  uint64_t rate[IDT_ENTRY_COUNT];
+  uint64_t load[MAX_CPU_COUNT];
+  bool pending[IDT_ENTRY_COUNT];
+
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&route_lock);
+
+  for (int i = 0; i < MAX_CPU_COUNT; i++)
+    load[i] = 0;
+
+  for (int irq = 0; irq < IDT_ENTRY_COUNT; irq++) {
+    uint64_t total = 0;
+    for (int c = 0; c < MAX_CPU_COUNT; c++)
+      if (online_mask & (1ull << c))
+        total += interrupt_getcount(c, irq);
+
+    rate[irq] = total - routes[irq].last_cnt;
+    routes[irq].last_cnt = total;
+    pending[irq] = routes[irq].retarget != NULL && rate[irq] != 0 &&
+                   interrupt_allowed(irq) != 0;
+  }
+
+  while (true) {
+    int heaviest = -1;
+    for (int irq = 0; irq < IDT_ENTRY_COUNT; irq++)
+      if (pending[irq] && (heaviest < 0 || rate[irq] > rate[heaviest]))
+        heaviest = irq;
+
+    if (heaviest < 0)
+      break;
+    pending[heaviest] = false;
+
+    uint64_t allowed = interrupt_allowed(heaviest);
+    int best = -1;
+    for (int c = 0; c < MAX_CPU_COUNT; c++)
+      if ((allowed & (1ull << c)) && (best < 0 || load[c] < load[best]))
+        best = c;
+
+    load[best] += rate[heaviest];
+    interrupt_moveto(heaviest, best);
+  }
+
+  local_spinlock_unlock(&route_lock);
+  interrupt_lowerpriority(prio);
+}
+
+static void interrupt_balance_tick(soft_timer_t *t, void *arg) {
+  arg = NULL;
+  interrupt_balance();
+  timer_arm(t, BALANCE_PERIOD_NS, BALANCE_SLACK_NS);
+}
+
+void interrupt_balance_init(void) {
+  timer_setup(&balance_timer, interrupt_balance_tick, NULL);
+  timer_arm(&balance_timer, BALANCE_PERIOD_NS, BALANCE_SLACK_NS);
+}
@@ -10,6 +10,7 @@
 #include "types.h"
 
 #include "cpuid.h"
+#include "debug.h"
 #include "interrupts.h"
 #include "memory.h"
 
@@ -24,6 +25,9 @@
 #define APIC_ICR_xAPIC_LO (0x300)
 #define APIC_ICR_xAPIC_HI (0x310)
 #define APIC_ICR_x2APIC (0x300)
+#define APIC_ICR_LOGICAL (1 << 11)
+#define APIC_ICR_PENDING (1 << 12)
+#define APIC_ICR_ALL_BUT_SELF (3 << 18)
 
 #define APIC_TIMER (0x320)
 #define APIC_ICoR (0x380)
@@ -42,6 +46,8 @@ typedef struct {
 } tls_apic_t;
 
 static TLS tls_apic_t *apic = NULL;
+static int apic_ids[MAX_CPU_COUNT];
+static uint32_t apic_ldrs[MAX_CPU_COUNT]; // x2apic logical ids, cluster << 16 | bit
 
 uint64_t apic_read(uint32_t off) {
   if (apic->x2apic_mode) {
@@ -89,6 +95,9 @@ void apic_init(void) {
   apic->id = apic_read(APIC_ID);
   if (!apic->x2apic_mode)
     apic->id = apic->id >> 24;
+  apic_ids[interrupt_get_cpunum()] = apic->id;
+  if (apic->x2apic_mode)
+    apic_ldrs[interrupt_get_cpunum()] = (uint32_t)apic_read(APIC_LDR);
 
   apic_write(APIC_TPR, 0);
   apic_write(APIC_SVR, (1 << 8) | 0xFF);
@@ -98,6 +107,20 @@ void apic_init(void) {
 
 int interrupt_get_cpuidx(void) { return apic->id; }
 
+int interrupt_get_apicid(int cpunum) { return apic_ids[cpunum]; }
+
+int interrupt_raisepriority(interrupt_priority_t prio) {
+  uint64_t cur = 0;
+  __asm__ volatile("mov %%cr8, %0" : "=r"(cur));
+  if ((uint64_t)prio > cur)
+    __asm__ volatile("mov %0, %%cr8" ::"r"((uint64_t)prio) : "memory");
+  return (int)cur;
+}
+
+void interrupt_lowerpriority(int prev) {
+  __asm__ volatile("mov %0, %%cr8" ::"r"((uint64_t)prev) : "memory");
+}
+
 void interrupt_sendeoi(int irq) {
   int byte_off = (irq / 32) * 16;
   int bit_off = irq % 32;
@@ -107,52 +130,163 @@ void interrupt_sendeoi(int irq) {
   }
 }
 
+static void apic_sendicr(uint32_t dest, uint32_t lo) {
+  if (apic->x2apic_mode) {
+    wrmsr(0x800 + APIC_ICR_x2APIC / 16, ((uint64_t)dest << 32) | lo);
+  } else {
+    // The previous IPI must have been accepted before the ICR is reused
+    while (apic_read(APIC_ICR_xAPIC_LO) & APIC_ICR_PENDING)
+      __asm__ volatile("pause");
+
+    apic_write(APIC_ICR_xAPIC_HI, dest << 24);
+    apic_write(APIC_ICR_xAPIC_LO, lo);
+  }
+}
+
 void interrupt_sendipi(int cpu, int vector, ipi_delivery_mode_t delivery_mode) {
-  uint64_t ipi_msg = 0;
+  uint32_t ipi_msg = 0;
   ipi_msg |= (vector & 0xff);
   ipi_msg |= (delivery_mode & 0x7) << 8;
   ipi_msg |= (1 << 14);
 
-  if (apic->x2apic_mode) {
-    ipi_msg |= ((uint64_t)cpu << 32);
+  apic_sendicr((uint32_t)cpu, ipi_msg);
+}
 
-    apic_write(APIC_ICR_x2APIC, ipi_msg);
-  } else {
-    ipi_msg |= ((uint64_t)cpu << 56);
+void interrupt_sendipi_mask(uint64_t mask, int vector) {
+  uint32_t ipi_msg = (vector & 0xff) | (1 << 14);
+  uint64_t others =
+      interrupt_getonlinemask() & ~(1ull << interrupt_get_cpunum());
+
+  if (mask == 0)
+    return;
+
+  // Every other core, a single IPI
+  if (mask == others) {
+    apic_sendicr(0, ipi_msg | APIC_ICR_ALL_BUT_SELF);
+    return;
+  }
+
+  if (!apic->x2apic_mode) {
+    for (int i = 0; i < MAX_CPU_COUNT; i++)
+      if (mask & (1ull << i))
+        apic_sendicr(apic_ids[i], ipi_msg);
+    return;
+  }
 
-    apic_write(APIC_ICR_xAPIC_HI, (uint32_t)(ipi_msg >> 32));
-    apic_write(APIC_ICR_xAPIC_LO, (uint32_t)ipi_msg);
+  // One logical IPI per x2apic cluster covers up to 16 cores
+  while (mask != 0) {
+    int first = __builtin_ctzll(mask);
+    uint32_t cluster = apic_ldrs[first] & 0xffff0000;
+    uint32_t dest = cluster;
+
+    for (int i = first; i < MAX_CPU_COUNT; i++)
+      if ((mask & (1ull << i)) && (apic_ldrs[i] & 0xffff0000) == cluster) {
+        dest |= apic_ldrs[i] & 0xffff;
+        mask &= ~(1ull << i);
+      }
+
+    apic_sendicr(dest, ipi_msg | APIC_ICR_LOGICAL);
   }
 }
 
 static int intrpt_num = 0;
 
-// configure timer for tsc deadline
-int local_apic_timer_init(bool tsc_mode, void (*handler)(int), bool ap) {
+// mode is the LVT timer mode: 0 one-shot, 1 periodic, 2 tsc deadline. The
+// timer stays stopped until the caller sets a count.
+int local_apic_timer_init(int mode, void (*handler)(int), bool ap) {
 
   if (!ap) {
-    intrpt_num = 50; // Allocate a low priority interrupt
-    interrupt_allocate(1, interrupt_flags_exclusive, &intrpt_num);
+    intrpt_num = 0xE0;
+    interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_timer,
+                       &intrpt_num);
     interrupt_registerhandler(intrpt_num, handler);
   }
 
+  // Stop any running countdown before switching modes
+  apic_write(APIC_ICoR, 0);
+
   uint64_t v = apic_read(APIC_TIMER);
   v = v & ~0x007100ff;
   v |= (intrpt_num & 0xff);
+  v |= ((mode & 3) << 17);
 
-  if (tsc_mode) {
-    v |= (2 << 17); // Set TSC-Deadline mode
-  } else {
-    v |= (1 << 17); // Set Periodic mode
-
-    // tick every 0.05ms
-    uint64_t apic_freq = get_cpuid()->apic_freq;
-    apic_write(APIC_ICoR, apic_freq / 20000);
-  }
-
+  // Count at the full bus rate, the rate itself is calibrated per core
+  apic_write(APIC_DCR, 0xB);
   apic_write(APIC_TIMER, v);
+
+  // The LVT write must land before any IA32_TSC_DEADLINE write
+  if (mode == 2)
+    __asm__ volatile("mfence" ::: "memory");
   return intrpt_num;
 }
 
+void apic_timer_setcount(uint32_t count) { apic_write(APIC_ICoR, count); }
+
+uint32_t apic_timer_getcount(void) { return apic_read(APIC_CCoR); }
+
 // task switches don't require callibration
-// sleep operations do require callibration - given frequency timers
\ No newline at end of file
+// sleep operations do require callibration - given frequency timers
+#ifdef BENCHMARK
+#define PRIO_BENCH_ITERS (1000)
+#define PRIO_BENCH_SPIN (20000) // cycles spent inside the critical section
+
+static volatile uint64_t prio_bench_stamp = 0;
+static volatile uint64_t prio_bench_lat = 0;
+static volatile bool prio_bench_hit = false;
+
+static void prio_bench_handler(int irq) {
+  irq = 0;
+  prio_bench_lat = rdtsc() - prio_bench_stamp;
+  prio_bench_hit = true;
+}
+
+// Worst case delay of a timer class interrupt raised inside a device level
+// critical section, masked either with cli or with the TPR
+static uint64_t prio_bench_run(int vec, bool use_tpr) {
+  uint64_t worst = 0;
+  for (int i = 0; i < PRIO_BENCH_ITERS; i++) {
+    int state = 0, prio = 0;
+    prio_bench_hit = false;
+
+    if (use_tpr)
+      prio = interrupt_raisepriority(interrupt_priority_device);
+    else
+      state = cli();
+
+    prio_bench_stamp = rdtsc();
+    interrupt_sendipi(apic->id, vec, ipi_delivery_mode_fixed);
+    while (rdtsc() - prio_bench_stamp < PRIO_BENCH_SPIN)
+      ;
+
+    if (use_tpr)
+      interrupt_lowerpriority(prio);
+    else
+      sti(state);
+
+    while (!prio_bench_hit)
+      __asm__ volatile("pause");
+    if (prio_bench_lat > worst)
+      worst = prio_bench_lat;
+  }
+  return worst;
+}
+
+void interrupt_priority_benchmark(void) {
+  int vec = 0;
+  if (interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_timer,
+                         &vec) != 0)
+    return;
+  interrupt_registerhandler(vec, prio_bench_handler);
+
+  uint64_t cli_lat = prio_bench_run(vec, false);
+  uint64_t tpr_lat = prio_bench_run(vec, true);
+
+  interrupt_unregisterhandler(vec, prio_bench_handler);
+
+  print_str("Worst timer latency cycles, cli: ");
+  print_uint64(cli_lat, BASE_HEX);
+  print_str(" TPR: ");
+  print_uint64(tpr_lat, BASE_HEX);
+  print_str("\r\n");
+}
+#endif
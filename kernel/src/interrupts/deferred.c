@@ -0,0 +1,220 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "types.h"
+
+#include "debug.h"
+#include "interrupts.h"
+#include "thread.h"
+
+#define DEFERRED_RING_SIZE (256)
+#define DEFERRED_EXIT_BUDGET (32)
+
+typedef struct {
+  DeferredWork func;
+  void *arg;
+  uint64_t stamp; // tsc when the work was raised
+} deferred_item_t;
+
+// Single producer/single consumer ring, both ends only ever touched by the
+// owning core. Producers run with interrupts disabled, the consumer with them
+// enabled, so the indices are the only shared state.
+typedef struct {
+  uint32_t head; // next item to run
+  uint32_t tail; // next free slot
+  bool running;
+  thread_t *worker; // takes over what the exit budget leaves behind
+
+  uint64_t ran;
+  uint64_t dropped;
+  uint64_t lat_total;
+  uint64_t lat_max;
+
+  deferred_item_t items[DEFERRED_RING_SIZE];
+} deferred_ring_t;
+
+static deferred_ring_t *rings[MAX_CPU_COUNT];
+
+void deferred_init(void) {
+  int cpu = interrupt_get_cpunum();
+  if (rings[cpu] != NULL)
+    return;
+
+  deferred_ring_t *ring = malloc(sizeof(deferred_ring_t));
+  if (ring == NULL)
+    PANIC("Deferred work ring allocation failure!");
+  memset(ring, 0, sizeof(deferred_ring_t));
+  rings[cpu] = ring;
+}
+
+int interrupt_defer(DeferredWork func, void *arg) {
+  int state = cli();
+  deferred_ring_t *ring = rings[interrupt_get_cpunum()];
+
+  uint32_t tail = ring->tail;
+  if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >=
+      DEFERRED_RING_SIZE) {
+    ring->dropped++;
+    sti(state);
+    return -1;
+  }
+
+  deferred_item_t *item = &ring->items[tail % DEFERRED_RING_SIZE];
+  item->func = func;
+  item->arg = arg;
+  item->stamp = rdtsc();
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+  sti(state);
+  return 0;
+}
+
+static void deferred_drain(deferred_ring_t *ring, int budget) {
+  for (int i = 0; i < budget; i++) {
+    uint32_t head = ring->head;
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+      return;
+
+    deferred_item_t item = ring->items[head % DEFERRED_RING_SIZE];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    uint64_t lat = rdtsc() - item.stamp;
+    ring->ran++;
+    ring->lat_total += lat;
+    if (lat > ring->lat_max)
+      ring->lat_max = lat;
+
+    item.func(item.arg);
+  }
+}
+
+// Called on the way out of the outermost interrupt, with interrupts disabled
+void deferred_irqexit(void) {
+  deferred_ring_t *ring = rings[interrupt_get_cpunum()];
+  if (ring == NULL || ring->running ||
+      ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    return;
+
+  ring->running = true;
+  sti(1);
+  deferred_drain(ring, DEFERRED_EXIT_BUDGET);
+  cli();
+  ring->running = false;
+
+  // Under sustained load the rest goes to the worker instead of waiting for
+  // the next interrupt
+  if (ring->worker != NULL &&
+      ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+    thread_wake(ring->worker);
+}
+
+// True while the calling core is draining its ring
+bool deferred_active(void) {
+  deferred_ring_t *ring = rings[interrupt_get_cpunum()];
+  return ring != NULL && ring->running;
+}
+
+bool deferred_pending(void) {
+  deferred_ring_t *ring = rings[interrupt_get_cpunum()];
+  return ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool deferred_run(int budget) {
+  int state = cli();
+  deferred_ring_t *ring = rings[interrupt_get_cpunum()];
+  if (ring->running) {
+    sti(state);
+    return false;
+  }
+
+  ring->running = true;
+  sti(state);
+  deferred_drain(ring, budget);
+  cli();
+  ring->running = false;
+
+  bool pending = ring->head != ring->tail;
+  sti(state);
+  return pending;
+}
+
+bool interrupt_rundeferred(void) { return deferred_run(DEFERRED_RING_SIZE); }
+
+// Drains in exit budget sized batches, switches are held off while draining
+// so this gives the scheduler a chance between them
+static void deferred_worker(void *arg) {
+  arg = NULL;
+  while (true)
+    if (!deferred_run(DEFERRED_EXIT_BUDGET))
+      thread_block();
+}
+
+void interrupt_deferred_startworker(void) {
+  deferred_ring_t *ring = rings[interrupt_get_cpunum()];
+  ring->worker = thread_create_local("deferred", deferred_worker, NULL,
+                                     THREAD_PRIO_DEFAULT);
+  if (ring->worker == NULL)
+    PANIC("Deferred worker creation failure!");
+}
+
+void interrupt_dumpdeferred(void) {
+  for (int i = 0; i < MAX_CPU_COUNT; i++) {
+    deferred_ring_t *ring = rings[i];
+    if (ring == NULL)
+      continue;
+
+    print_str("[Core: ");
+    print_int32(i, BASE_HEX);
+    print_str("] Deferred Ran: ");
+    print_uint64(ring->ran, BASE_HEX);
+    print_str(" Dropped: ");
+    print_uint64(ring->dropped, BASE_HEX);
+    print_str(" Avg Latency: ");
+    print_uint64(ring->ran ? ring->lat_total / ring->ran : 0, BASE_HEX);
+    print_str(" Max Latency: ");
+    print_uint64(ring->lat_max, BASE_HEX);
+    print_str("\r\n");
+  }
+}
+
+#ifdef BENCHMARK
+#define DEFERRED_BENCH_ITERS (10000)
+
+static volatile uint64_t deferred_bench_cnt = 0;
+
+static void deferred_bench_work(void *arg) {
+  arg = NULL;
+  deferred_bench_cnt++;
+}
+
+static void deferred_bench_handler(int int_num) {
+  int_num = 0;
+  interrupt_defer(deferred_bench_work, NULL);
+}
+
+// Self-IPIs that each raise one work item, reports raise-to-run latency
+void interrupt_deferred_benchmark(void) {
+  int vec = 0;
+  if (interrupt_allocate(1, interrupt_flags_exclusive, &vec) != 0)
+    return;
+  interrupt_registerhandler(vec, deferred_bench_handler);
+
+  for (int i = 0; i < DEFERRED_BENCH_ITERS; i++) {
+    uint64_t c = deferred_bench_cnt;
+    interrupt_sendipi(interrupt_get_cpuidx(), vec, ipi_delivery_mode_fixed);
+    while (deferred_bench_cnt == c)
+      __asm__ volatile("pause");
+  }
+
+  interrupt_unregisterhandler(vec, deferred_bench_handler);
+  interrupt_dumpdeferred();
+}
+#endif
@@ -17,8 +17,8 @@
 
 #define IDT_ENTRY_COUNT (256)
 #define IDT_HANDLER_CNT (16)
-#define IDT_ENTRY_HANDLER_SIZE (64)
 #define IDT_TYPE_INTR (0xE)
+#define IRQ_HIST_BUCKETS (32)
 
 typedef struct {
   uint32_t offset0 : 16;
@@ -67,56 +67,208 @@ typedef struct {
 
 typedef struct {
   idt_t *idt;
-  regs_t *reg_state;
-  regs_t *reg_ref;
+  regs_t *reg_ref; // frame of the interrupt currently being handled
   int proc_idx;
 } tls_idt_t;
 
+typedef struct handler_set {
+  int cnt;
+  InterruptHandler funcs[IDT_HANDLER_CNT];
+  struct handler_set *next; // retirement list link
+} handler_set_t;
+
+typedef struct {
+  uint64_t seq; // odd while the core is dispatching
+  int depth;
+} ALIGNED(64) dispatch_state_t;
+
+// Per-core dispatch statistics, only ever written by the owning core
+typedef struct {
+  uint64_t count[IDT_ENTRY_COUNT];
+  uint32_t hist[IDT_ENTRY_COUNT][IRQ_HIST_BUCKETS]; // log2 of handler cycles
+} irq_stats_t;
+
 static TLS tls_idt_t *idt = NULL;
-static char idt_handlers[IDT_ENTRY_COUNT][IDT_ENTRY_HANDLER_SIZE];
-static InterruptHandler interrupt_funcs[IDT_ENTRY_COUNT][IDT_HANDLER_CNT];
+extern uint64_t idt_stubs[IDT_ENTRY_COUNT]; // idt_entry.S
+
+void deferred_init(void);
+void deferred_irqexit(void);
+bool deferred_active(void);
+static handler_set_t *interrupt_sets[IDT_ENTRY_COUNT];
+static handler_set_t *local_sets[MAX_CPU_COUNT][IDT_ENTRY_COUNT];
+static handler_set_t *retired_sets = NULL;
+static dispatch_state_t dispatch_state[MAX_CPU_COUNT];
+static irq_stats_t *irq_stats[MAX_CPU_COUNT];
 static bool interrupt_blocked[IDT_ENTRY_COUNT];
+static bool local_blocked[MAX_CPU_COUNT][IDT_ENTRY_COUNT];
+static int local_use[IDT_ENTRY_COUNT]; // cores holding the vector locally
 static int interrupt_alloc_lock = 0;
 static _Atomic int proc_idx_cntr = 0;
 static bool int_arr_inited = false;
+static InterruptSwitch interrupt_switch = NULL;
+static void (*interrupt_switchdone)(void) = NULL;
+
+// Handlers are published as immutable sets so dispatch never takes a lock.
+// A replaced set is only freed once every other core has left dispatch.
+static handler_set_t *interrupt_newset(handler_set_t **slot) {
+  handler_set_t *set = malloc(sizeof(handler_set_t));
+  if (set == NULL)
+    PANIC("Handler set allocation failure!");
+
+  handler_set_t *cur = *slot;
+  if (cur != NULL)
+    memcpy(set, cur, sizeof(handler_set_t));
+  else
+    set->cnt = 0;
+  set->next = NULL;
+  return set;
+}
 
-void interrupt_registerhandler(int irq, InterruptHandler handler) {
-  int state = cli();
+void interrupt_quiesce(void) {
+  uint64_t snap[MAX_CPU_COUNT];
+  int cpu_cnt = proc_idx_cntr;
+  int self = idt->proc_idx;
+
+  for (int i = 0; i < cpu_cnt; i++)
+    snap[i] = __atomic_load_n(&dispatch_state[i].seq, __ATOMIC_SEQ_CST);
+
+  // An odd sequence means the core is inside dispatch, wait for it to move on
+  for (int i = 0; i < cpu_cnt; i++)
+    if (i != self && (snap[i] & 1))
+      while (__atomic_load_n(&dispatch_state[i].seq, __ATOMIC_ACQUIRE) ==
+             snap[i])
+        __asm__ volatile("pause");
+}
+
+static void interrupt_retire(handler_set_t *set) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
   local_spinlock_lock(&interrupt_alloc_lock);
-  for (int i = 0; i < IDT_HANDLER_CNT; i++)
-    if (interrupt_funcs[irq][i] == NULL) {
-      interrupt_funcs[irq][i] = handler;
-      local_spinlock_unlock(&interrupt_alloc_lock);
-      sti(state);
-      return;
-    }
+  if (set != NULL) {
+    set->next = retired_sets;
+    retired_sets = set;
+  }
+
+  // Registration from inside a handler may still be walking the old set
+  if (dispatch_state[idt->proc_idx].depth != 0) {
+    local_spinlock_unlock(&interrupt_alloc_lock);
+    interrupt_lowerpriority(prio);
+    return;
+  }
+
+  handler_set_t *list = retired_sets;
+  retired_sets = NULL;
   local_spinlock_unlock(&interrupt_alloc_lock);
-  sti(state);
+  interrupt_lowerpriority(prio);
+
+  if (list == NULL)
+    return;
 
-  PANIC("Interrupt oversubscribed!");
+  interrupt_quiesce();
+  while (list != NULL) {
+    handler_set_t *next = list->next;
+    free(list);
+    list = next;
+  }
 }
 
-void interrupt_unregisterhandler(int irq, InterruptHandler handler) {
-  int state = cli();
+static void interrupt_addhandler(handler_set_t **slot,
+                                 InterruptHandler handler) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
   local_spinlock_lock(&interrupt_alloc_lock);
-  for (int i = 0; i < IDT_HANDLER_CNT; i++)
-    if (interrupt_funcs[irq][i] == handler) {
-      interrupt_funcs[irq][i] = NULL;
-    }
+
+  handler_set_t *o_set = *slot;
+  if (o_set != NULL && o_set->cnt >= IDT_HANDLER_CNT) {
+    local_spinlock_unlock(&interrupt_alloc_lock);
+    interrupt_lowerpriority(prio);
+    PANIC("Interrupt oversubscribed!");
+  }
+
+  handler_set_t *n_set = interrupt_newset(slot);
+  n_set->funcs[n_set->cnt++] = handler;
+  __atomic_store_n(slot, n_set, __ATOMIC_SEQ_CST);
 
   local_spinlock_unlock(&interrupt_alloc_lock);
-  sti(state);
+  interrupt_lowerpriority(prio);
+
+  interrupt_retire(o_set);
+}
+
+static void interrupt_removehandler(handler_set_t **slot,
+                                    InterruptHandler handler) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&interrupt_alloc_lock);
+
+  handler_set_t *o_set = *slot;
+  if (o_set == NULL) {
+    local_spinlock_unlock(&interrupt_alloc_lock);
+    interrupt_lowerpriority(prio);
+    return;
+  }
+
+  handler_set_t *n_set = interrupt_newset(slot);
+  n_set->cnt = 0;
+  for (int i = 0; i < o_set->cnt; i++)
+    if (o_set->funcs[i] != handler)
+      n_set->funcs[n_set->cnt++] = o_set->funcs[i];
+
+  if (n_set->cnt == 0) {
+    free(n_set);
+    n_set = NULL;
+  }
+  __atomic_store_n(slot, n_set, __ATOMIC_SEQ_CST);
+
+  local_spinlock_unlock(&interrupt_alloc_lock);
+  interrupt_lowerpriority(prio);
+
+  interrupt_retire(o_set);
+}
+
+void interrupt_registerhandler(int irq, InterruptHandler handler) {
+  interrupt_addhandler(&interrupt_sets[irq], handler);
+}
+
+void interrupt_unregisterhandler(int irq, InterruptHandler handler) {
+  interrupt_removehandler(&interrupt_sets[irq], handler);
+}
+
+void interrupt_registerhandler_local(int cpunum, int irq,
+                                    InterruptHandler handler) {
+  interrupt_addhandler(&local_sets[cpunum][irq], handler);
+}
+
+void interrupt_unregisterhandler_local(int cpunum, int irq,
+                                      InterruptHandler handler) {
+  interrupt_removehandler(&local_sets[cpunum][irq], handler);
+}
+
+// Vector range of each priority class, the class is the upper nibble
+static void interrupt_getrange(interrupt_flags_t flags, int *lo, int *hi) {
+  if (flags & interrupt_flags_ipi) {
+    *lo = 0xF0;
+    *hi = 0xFE;
+  } else if (flags & interrupt_flags_timer) {
+    *lo = 0xE0;
+    *hi = 0xEF;
+  } else {
+    *lo = 0x20;
+    *hi = 0x8F;
+  }
+}
+
+// A vector is free globally only if no core has claimed it for itself
+static bool interrupt_isfree(int irq) {
+  return !interrupt_blocked[irq] && local_use[irq] == 0;
 }
 
 int interrupt_allocate(int cnt, interrupt_flags_t flags, int *base) {
   if (flags & interrupt_flags_fixed) {
-    int state = cli();
+    int prio = interrupt_raisepriority(interrupt_priority_device);
     local_spinlock_lock(&interrupt_alloc_lock);
 
     for (int c = 0; c < cnt; c++) {
-      if (interrupt_blocked[*base + c]) {
+      if (!interrupt_isfree(*base + c)) {
         local_spinlock_unlock(&interrupt_alloc_lock);
-        sti(state);
+        interrupt_lowerpriority(prio);
         return -1;
       }
     }
@@ -126,7 +278,7 @@ int interrupt_allocate(int cnt, interrupt_flags_t flags, int *base) {
         interrupt_blocked[*base + c] = true;
 
     local_spinlock_unlock(&interrupt_alloc_lock);
-    sti(state);
+    interrupt_lowerpriority(prio);
     return 0;
   } else {
     // if fixed allocation works, use it
@@ -137,56 +289,139 @@ int interrupt_allocate(int cnt, interrupt_flags_t flags, int *base) {
     }
 
     // find a block that does work
-    int state = cli();
+    int prio = interrupt_raisepriority(interrupt_priority_device);
     local_spinlock_lock(&interrupt_alloc_lock);
 
-    int run_off = 32; // IRQs start at 32 for x86
+    int lo = 0, hi = 0;
+    interrupt_getrange(flags, &lo, &hi);
+
+    int run_off = lo;
     int run_len = 0;
-    for (int i = 32; i < IDT_ENTRY_COUNT; i++) {
-      if (run_len >= cnt) {
+    for (int i = lo; i <= hi; i++) {
+      if (!interrupt_isfree(i)) {
+        run_len = 0;
+        run_off = i + 1;
+        continue;
+      }
+
+      if (++run_len >= cnt) {
         if (flags & interrupt_flags_exclusive)
           for (int c = 0; c < cnt; c++)
             interrupt_blocked[run_off + c] = true;
 
         *base = run_off;
         local_spinlock_unlock(&interrupt_alloc_lock);
-        sti(state);
+        interrupt_lowerpriority(prio);
         return 0;
       }
-
-      if (interrupt_blocked[i]) {
-        run_len = 0;
-        run_off = i + 1;
-      } else
-        run_len++;
     }
 
     local_spinlock_unlock(&interrupt_alloc_lock);
-    sti(state);
+    interrupt_lowerpriority(prio);
     return -1;
   }
 }
 
-void idt_mainhandler(regs_t *regs) {
-  // Store the registers in the processor interrupt state
-  regs->int_no = (uint8_t)regs->int_no;
+int interrupt_allocate_local(int cpunum, int cnt, interrupt_flags_t flags,
+                             int *base) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&interrupt_alloc_lock);
 
-  memcpy(idt->reg_state, regs, sizeof(regs_t));
-  idt->reg_ref = regs;
+  int lo = 0, hi = 0;
+  interrupt_getrange(flags, &lo, &hi);
+
+  int run_off = lo;
+  int run_len = 0;
+  for (int i = lo; i <= hi && run_len < cnt; i++) {
+    if (interrupt_blocked[i] || interrupt_sets[i] != NULL ||
+        local_blocked[cpunum][i]) {
+      run_len = 0;
+      run_off = i + 1;
+    } else
+      run_len++;
+  }
 
-  bool handled = false;
+  if (run_len < cnt) {
+    local_spinlock_unlock(&interrupt_alloc_lock);
+    interrupt_lowerpriority(prio);
+    return -1;
+  }
 
-  int state = cli();
+  for (int c = 0; c < cnt; c++) {
+    local_blocked[cpunum][run_off + c] = true;
+    local_use[run_off + c]++;
+  }
+  *base = run_off;
 
+  local_spinlock_unlock(&interrupt_alloc_lock);
+  interrupt_lowerpriority(prio);
+  return 0;
+}
+
+void interrupt_free(int base, int cnt) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
   local_spinlock_lock(&interrupt_alloc_lock);
-  for (int i = 0; i < IDT_HANDLER_CNT; i++) {
-    if (interrupt_funcs[regs->int_no][i] != NULL) {
-      interrupt_funcs[regs->int_no][i](regs->int_no);
-      handled = true;
-    }
+
+  for (int c = 0; c < cnt; c++)
+    interrupt_blocked[base + c] = false;
+
+  local_spinlock_unlock(&interrupt_alloc_lock);
+  interrupt_lowerpriority(prio);
+}
+
+void interrupt_free_local(int cpunum, int base, int cnt) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&interrupt_alloc_lock);
+
+  for (int c = 0; c < cnt; c++) {
+    if (!local_blocked[cpunum][base + c])
+      continue;
+    local_blocked[cpunum][base + c] = false;
+    local_use[base + c]--;
   }
+
   local_spinlock_unlock(&interrupt_alloc_lock);
-  sti(state);
+  interrupt_lowerpriority(prio);
+}
+
+// Returns the frame to resume, idt_entry.S moves onto it if it isn't regs
+regs_t *idt_mainhandler(regs_t *regs) {
+  // Expose the frame in place, restoring the outer one when nested
+  regs_t *prev_ref = idt->reg_ref;
+  idt->reg_ref = regs;
+
+  bool handled = false;
+
+  // Mark this core as dispatching, nested exceptions keep the outer marker
+  dispatch_state_t *ds = &dispatch_state[idt->proc_idx];
+  if (ds->depth++ == 0)
+    __atomic_fetch_add(&ds->seq, 1, __ATOMIC_SEQ_CST);
+
+  // Vectors claimed by this core take precedence over the shared table
+  handler_set_t *set = __atomic_load_n(&local_sets[idt->proc_idx][regs->int_no],
+                                       __ATOMIC_ACQUIRE);
+  if (set == NULL)
+    set = __atomic_load_n(&interrupt_sets[regs->int_no], __ATOMIC_ACQUIRE);
+  uint64_t start = rdtsc();
+  if (set != NULL) {
+    if (set->cnt == 1)
+      set->funcs[0](regs->int_no);
+    else
+      for (int i = 0; i < set->cnt; i++)
+        set->funcs[i](regs->int_no);
+    handled = set->cnt > 0;
+  }
+  uint64_t cycles = rdtsc() - start;
+
+  irq_stats_t *stats = irq_stats[idt->proc_idx];
+  int bucket = (cycles == 0) ? 0 : 63 - __builtin_clzll(cycles);
+  if (bucket >= IRQ_HIST_BUCKETS)
+    bucket = IRQ_HIST_BUCKETS - 1;
+  stats->count[regs->int_no]++;
+  stats->hist[regs->int_no][bucket]++;
+
+  if (--ds->depth == 0)
+    __atomic_fetch_add(&ds->seq, 1, __ATOMIC_RELEASE);
 
   if (!handled) {
     print_str("[Core: ");
@@ -197,41 +432,123 @@ void idt_mainhandler(regs_t *regs) {
     PANIC("Failure!");
   }
 
-  idt->reg_ref = NULL;
+  idt->reg_ref = prev_ref;
 
   if (regs->int_no >= 32)
     interrupt_sendeoi(regs->int_no);
+
+  // Run deferred work once the outermost handler is done, unless the
+  // interrupted code had interrupts disabled. The same goes for switching
+  // threads, which also waits for any drain this interrupted to finish.
+  regs_t *next = regs;
+  if (ds->depth == 0 && (regs->rflags & 0x200)) {
+    deferred_irqexit();
+    if (interrupt_switch != NULL && !deferred_active())
+      next = (regs_t *)interrupt_switch(regs);
+  }
+  return next;
 }
 
-void interrupt_setregisterstate(interrupt_register_state_t *state) {
-  if (state != NULL) {
+// Runs on the new frame's stack, the old one is no longer in use
+void idt_switchdone(void) {
+  if (interrupt_switchdone != NULL)
+    interrupt_switchdone();
+}
+
+void interrupt_setswitch(InterruptSwitch pick, void (*done)(void)) {
+  interrupt_switchdone = done;
+  __atomic_store_n(&interrupt_switch, pick, __ATOMIC_RELEASE);
+}
 
-    idt->reg_ref->r15 = state->r15;
-    idt->reg_ref->r14 = state->r14;
-    idt->reg_ref->r13 = state->r13;
-    idt->reg_ref->r12 = state->r12;
-    idt->reg_ref->r11 = state->r11;
-    idt->reg_ref->r10 = state->r10;
-    idt->reg_ref->r9 = state->r9;
-    idt->reg_ref->r8 = state->r8;
-    idt->reg_ref->rdi = state->rdi;
-    idt->reg_ref->rsi = state->rsi;
-    idt->reg_ref->rdx = state->rdx;
-    idt->reg_ref->rcx = state->rcx;
-    idt->reg_ref->rbx = state->rbx;
-    idt->reg_ref->rax = state->rax;
-
-    idt->reg_ref->rflags = state->rflags;
-    idt->reg_ref->rip = state->rip;
-
-    idt->reg_ref->cs = state->cs;
-    idt->reg_ref->ss = state->ss;
-
-    idt->reg_ref->rbp = state->rbp;
-    idt->reg_ref->useresp = state->rsp;
+int interrupt_get_cpunum(void) { return idt->proc_idx; }
+
+uint64_t interrupt_getcount(int cpunum, int irq) {
+  if (irq_stats[cpunum] == NULL)
+    return 0;
+  return __atomic_load_n(&irq_stats[cpunum]->count[irq], __ATOMIC_RELAXED);
+}
+
+void interrupt_dumpstats(void) {
+  for (int irq = 0; irq < IDT_ENTRY_COUNT; irq++) {
+    uint64_t total = 0;
+    for (int c = 0; c < MAX_CPU_COUNT; c++)
+      total += interrupt_getcount(c, irq);
+    if (total == 0)
+      continue;
+
+    print_str("Vector ");
+    print_uint8((uint8_t)irq, BASE_HEX);
+    print_str(": ");
+    print_uint64(total, BASE_HEX);
+    print_str("\r\n  Cores:");
+    for (int c = 0; c < MAX_CPU_COUNT; c++) {
+      uint64_t cnt = interrupt_getcount(c, irq);
+      if (cnt == 0)
+        continue;
+      print_str(" ");
+      print_int32(c, BASE_HEX);
+      print_str("=");
+      print_uint64(cnt, BASE_HEX);
+    }
+
+    // Bucket b holds handlers that took [2^b, 2^(b+1)) cycles
+    print_str("\r\n  Cycles:");
+    for (int b = 0; b < IRQ_HIST_BUCKETS; b++) {
+      uint64_t cnt = 0;
+      for (int c = 0; c < MAX_CPU_COUNT; c++)
+        if (irq_stats[c] != NULL)
+          cnt += irq_stats[c]->hist[irq][b];
+      if (cnt == 0)
+        continue;
+      print_str(" 2^");
+      print_int32(b, BASE_HEX);
+      print_str("=");
+      print_uint64(cnt, BASE_HEX);
+    }
+    print_str("\r\n");
   }
 }
 
+static void idt_setframe(regs_t *frame, interrupt_register_state_t *state) {
+  frame->r15 = state->r15;
+  frame->r14 = state->r14;
+  frame->r13 = state->r13;
+  frame->r12 = state->r12;
+  frame->r11 = state->r11;
+  frame->r10 = state->r10;
+  frame->r9 = state->r9;
+  frame->r8 = state->r8;
+  frame->rdi = state->rdi;
+  frame->rsi = state->rsi;
+  frame->rdx = state->rdx;
+  frame->rcx = state->rcx;
+  frame->rbx = state->rbx;
+  frame->rax = state->rax;
+
+  frame->rflags = state->rflags;
+  frame->rip = state->rip;
+
+  frame->cs = state->cs;
+  frame->ss = state->ss;
+
+  frame->rbp = state->rbp;
+  frame->useresp = state->rsp;
+}
+
+void interrupt_setregisterstate(interrupt_register_state_t *state) {
+  if (state != NULL)
+    idt_setframe(idt->reg_ref, state);
+}
+
+void *interrupt_buildframe(void *stack, interrupt_register_state_t *state) {
+  // Aligned the way the cpu aligns a frame on entry
+  regs_t *frame = (regs_t *)(((uintptr_t)stack & ~0xFull) - sizeof(regs_t));
+  memset(frame, 0, sizeof(regs_t));
+  frame->rsp = (uint64_t)frame;
+  idt_setframe(frame, state);
+  return frame;
+}
+
 void interrupt_getregisterstate(interrupt_register_state_t *state) {
   if (state != NULL) {
 
@@ -261,103 +578,35 @@ void interrupt_getregisterstate(interrupt_register_state_t *state) {
   }
 }
 
-NAKED NORETURN static void idt_defaulthandler() {
-  __asm__ volatile("pushq %rbx\n\t"
-                   "pushq %rcx\n\t"
-                   "pushq %rdx\n\t"
-                   "pushq %rbp\n\t"
-                   "pushq %rsi\n\t"
-                   "pushq %rdi\n\t"
-                   "pushq %r8\n\t"
-                   "pushq %r9\n\t"
-                   "pushq %r10\n\t"
-                   "pushq %r11\n\t"
-                   "pushq %r12\n\t"
-                   "pushq %r13\n\t"
-                   "pushq %r14\n\t"
-                   "pushq %r15\n\t"
-                   "movq %rsp, %rdi\n\t"
-                   "pushq %rdi\n\t"
-                   "movq %rsp, %rdi\n\t"
-                   "callq idt_mainhandler\n\t"
-                   "popq %rdi\n\t"
-                   "popq %r15\n\t"
-                   "popq %r14\n\t"
-                   "popq %r13\n\t"
-                   "popq %r12\n\t"
-                   "popq %r11\n\t"
-                   "popq %r10\n\t"
-                   "popq %r9\n\t"
-                   "popq %r8\n\t"
-                   "popq %rdi\n\t"
-                   "popq %rsi\n\t"
-                   "popq %rbp\n\t"
-                   "popq %rdx\n\t"
-                   "popq %rcx\n\t"
-                   "popq %rbx\n\t"
-                   "popq %rax\n\t"
-                   "add $16, %rsp\n\t"
-                   "iretq\n\t");
-}
-
-static void idt_fillswinterrupthandler(char *idt_handler, uint8_t intNum,
-                                       uint8_t pushToStack) {
-  int index = 0;
-
-  // Push dummy error code if the interrupt doesn't do so
-  if (pushToStack) {
-    idt_handler[index++] = 0x6a; // Push
-    idt_handler[index++] = pushToStack;
-  }
-
-  idt_handler[index++] = 0x6a;   // Push
-  idt_handler[index++] = intNum; // Push the interrupt number to stack
-
-  // push jump address and ret
-  idt_handler[index++] = 0x50; // push %%rax
-  idt_handler[index++] = 0x48; // movq idt_defaulthandler, %%rax
-  idt_handler[index++] = 0xb8;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler)) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> (8)) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> (16)) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> (24)) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> 32) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> (32 + 8)) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> (32 + 16)) & 0xff;
-  idt_handler[index++] = ((uint64_t)(idt_defaulthandler) >> (32 + 24)) & 0xff;
-  //*(uint32_t*)&idt_handler[index] = 0x11223344;
-  // index += 3;
-  idt_handler[index++] = 0x50; // push %%rax
-  idt_handler[index++] = 0xC3; // retq
-}
-
 void idt_init(void) {
   if (idt == NULL) {
     idt = (TLS tls_idt_t *)tls_alloc(sizeof(tls_idt_t));
   }
   idt->proc_idx = proc_idx_cntr++;
+  if (idt->proc_idx >= MAX_CPU_COUNT)
+    PANIC("Too many cores!");
+  deferred_init();
+
+  // Pad to whole cache lines so no two cores' counters share a line
+  if (irq_stats[idt->proc_idx] == NULL) {
+    uintptr_t stats = (uintptr_t)malloc(sizeof(irq_stats_t) + 64);
+    if (stats == 0)
+      PANIC("Interrupt statistics allocation failure!");
+    stats = ALIGN(stats, 64);
+    memset((void *)stats, 0, sizeof(irq_stats_t));
+    irq_stats[idt->proc_idx] = (irq_stats_t *)stats;
+  }
   idt->idt = malloc(IDT_ENTRY_COUNT * sizeof(idt_t));
-  idt->reg_state = malloc(sizeof(regs_t));
+  idt->reg_ref = NULL;
 
   // Fill the IDT
   idt_t *idt_lcl = idt->idt;
 
-  int pushesToStack = 1;
   if (!int_arr_inited) {
 
     for (int i = 0; i < IDT_ENTRY_COUNT; i++) {
-      if (i == 8 || (i >= 10 && i <= 14))
-        pushesToStack = 0;
-      idt_fillswinterrupthandler(
-          idt_handlers[i], i,
-          pushesToStack); // If pushesToStack is non-zero, the value will be
-                          // pushed to stack
-
       interrupt_blocked[i] = false;
-      for (int j = 0; j < IDT_HANDLER_CNT; j++)
-        interrupt_funcs[i][j] = NULL;
-
-      pushesToStack = 1;
+      interrupt_sets[i] = NULL;
     }
 
     int_arr_inited = true;
@@ -365,9 +614,9 @@ void idt_init(void) {
 
   for (int i = 0; i < IDT_ENTRY_COUNT; i++) {
     // Setup interrupts
-    idt_lcl[i].offset0 = (uint64_t)idt_handlers[i] & 0xFFFF;
-    idt_lcl[i].offset1 = ((uint64_t)idt_handlers[i] >> 16) & 0xFFFF;
-    idt_lcl[i].offset2 = ((uint64_t)idt_handlers[i] >> 32) & 0xFFFFFFFF;
+    idt_lcl[i].offset0 = idt_stubs[i] & 0xFFFF;
+    idt_lcl[i].offset1 = (idt_stubs[i] >> 16) & 0xFFFF;
+    idt_lcl[i].offset2 = (idt_stubs[i] >> 32) & 0xFFFFFFFF;
     idt_lcl[i].seg_select = 0x08;
     idt_lcl[i].type = IDT_TYPE_INTR;
     idt_lcl[i].p = 1;
@@ -383,4 +632,162 @@ void idt_init(void) {
   idtr.base = idt->idt;
 
   __asm__ volatile("lidt (%0)" ::"r"(&idtr));
-}
\ No newline at end of file
+}
+
+#ifdef BENCHMARK
+#define IRQ_BENCH_ITERS (100000)
+#define IRQ_BENCH_SWVEC (0x81)
+#define IRQ_BENCH_LEGACYVEC (0x82) // next to SWVEC, pushed by idt_legacy_stub
+
+static int irq_bench_vec = 0;
+static _Atomic int irq_bench_go = 0;
+static _Atomic int irq_bench_done = 0;
+static volatile uint64_t irq_bench_cnt[MAX_CPU_COUNT];
+static uint64_t irq_bench_cycles[MAX_CPU_COUNT];
+
+static void irq_bench_handler(int int_num) {
+  int_num = 0;
+  irq_bench_cnt[idt->proc_idx]++;
+}
+
+// Baseline, runs the handler under the allocation lock the way dispatch did
+// before handler sets
+static void irq_bench_locked_handler(int int_num) {
+  local_spinlock_lock(&interrupt_alloc_lock);
+  irq_bench_handler(int_num);
+  local_spinlock_unlock(&interrupt_alloc_lock);
+}
+
+// Self-IPI round trips, every core runs concurrently so dispatch contention shows up
+static void irq_bench_run(void) {
+  int cpu = idt->proc_idx;
+  int apic_id = interrupt_get_cpuidx();
+
+  uint64_t start = rdtsc();
+  for (int i = 0; i < IRQ_BENCH_ITERS; i++) {
+    uint64_t c = irq_bench_cnt[cpu];
+    interrupt_sendipi(apic_id, irq_bench_vec, ipi_delivery_mode_fixed);
+    while (irq_bench_cnt[cpu] == c)
+      __asm__ volatile("pause");
+  }
+  irq_bench_cycles[cpu] = rdtsc() - start;
+  irq_bench_done++;
+}
+
+static void irq_bench_nop(int int_num) { int_num = 0; }
+
+extern char idt_legacy_stub[]; // idt_entry.S
+static regs_t irq_bench_regs[MAX_CPU_COUNT];
+
+// Dispatch as the previous entry path did, after copying the frame out
+regs_t *idt_legacy_mainhandler(regs_t *regs) {
+  regs->int_no = (uint8_t)regs->int_no;
+  memcpy(&irq_bench_regs[idt->proc_idx], regs, sizeof(regs_t));
+  return idt_mainhandler(regs);
+}
+
+static uint64_t irq_bench_int(int vec) {
+  uint64_t start = rdtsc();
+  if (vec == IRQ_BENCH_SWVEC)
+    for (int i = 0; i < IRQ_BENCH_ITERS; i++)
+      __asm__ volatile("int %0" ::"i"(IRQ_BENCH_SWVEC) : "memory");
+  else
+    for (int i = 0; i < IRQ_BENCH_ITERS; i++)
+      __asm__ volatile("int %0" ::"i"(IRQ_BENCH_LEGACYVEC) : "memory");
+  return (rdtsc() - start) / IRQ_BENCH_ITERS;
+}
+
+// Software interrupt round trip, entry stub through dispatch and iretq. The
+// previous push/ret stub and frame copy run on a second vector, pointed at it
+// in this core's IDT only, for a baseline.
+static void irq_bench_entry(void) {
+  int vec = IRQ_BENCH_SWVEC;
+  int legacy_vec = IRQ_BENCH_LEGACYVEC;
+  if (interrupt_allocate(2, interrupt_flags_exclusive | interrupt_flags_fixed,
+                         &vec) != 0) {
+    print_str("Interrupt entry benchmark: vectors in use.\r\n");
+    return;
+  }
+  interrupt_registerhandler(vec, irq_bench_nop);
+  interrupt_registerhandler(legacy_vec, irq_bench_nop);
+
+  int state = cli();
+  idt_t *gate = &idt->idt[legacy_vec];
+  gate->offset0 = (uint64_t)idt_legacy_stub & 0xFFFF;
+  gate->offset1 = ((uint64_t)idt_legacy_stub >> 16) & 0xFFFF;
+  gate->offset2 = ((uint64_t)idt_legacy_stub >> 32) & 0xFFFFFFFF;
+
+  uint64_t legacy = irq_bench_int(legacy_vec);
+  uint64_t cur = irq_bench_int(vec);
+
+  gate->offset0 = idt_stubs[legacy_vec] & 0xFFFF;
+  gate->offset1 = (idt_stubs[legacy_vec] >> 16) & 0xFFFF;
+  gate->offset2 = (idt_stubs[legacy_vec] >> 32) & 0xFFFFFFFF;
+  sti(state);
+
+  interrupt_unregisterhandler(vec, irq_bench_nop);
+  interrupt_unregisterhandler(legacy_vec, irq_bench_nop);
+  interrupt_free(vec, 2);
+
+  print_str("Interrupt round trip cycles, previous entry: ");
+  print_uint64(legacy, BASE_HEX);
+  print_str(" assembled stubs: ");
+  print_uint64(cur, BASE_HEX);
+  print_str("\r\n");
+}
+
+// Two rounds on every core at once, first with the locked baseline dispatch
+void interrupt_benchmark_ap(void) {
+  for (int round = 1; round <= 2; round++) {
+    while (irq_bench_go < round)
+      __asm__ volatile("pause");
+    irq_bench_run();
+  }
+}
+
+// Only online cores take part, a core left out of bring up still has an index
+static void irq_bench_round(int round, const char *label) {
+  uint64_t online = interrupt_getonlinemask();
+  int cnt = __builtin_popcountll(online);
+
+  irq_bench_done = 0;
+  irq_bench_go = round;
+  irq_bench_run();
+  while (irq_bench_done < cnt)
+    __asm__ volatile("pause");
+
+  uint64_t total = 0;
+  for (int i = 0; i < MAX_CPU_COUNT; i++) {
+    if (!(online & (1ull << i)))
+      continue;
+    print_str("[Core: ");
+    print_int32(i, BASE_HEX);
+    print_str("] ");
+    print_str(label);
+    print_str(" cycles per interrupt: ");
+    print_uint64(irq_bench_cycles[i] / IRQ_BENCH_ITERS, BASE_HEX);
+    print_str("\r\n");
+    total += irq_bench_cycles[i];
+  }
+  print_str(label);
+  print_str(" average cycles per interrupt: ");
+  print_uint64(total / ((uint64_t)cnt * IRQ_BENCH_ITERS), BASE_HEX);
+  print_str("\r\n");
+}
+
+void interrupt_benchmark(void) {
+  irq_bench_entry();
+
+  interrupt_allocate(1, interrupt_flags_exclusive, &irq_bench_vec);
+
+  interrupt_registerhandler(irq_bench_vec, irq_bench_locked_handler);
+  irq_bench_round(1, "Locked dispatch");
+  interrupt_unregisterhandler(irq_bench_vec, irq_bench_locked_handler);
+
+  interrupt_registerhandler(irq_bench_vec, irq_bench_handler);
+  irq_bench_round(2, "Lock-free dispatch");
+
+  interrupt_unregisterhandler(irq_bench_vec, irq_bench_handler);
+  interrupt_free(irq_bench_vec, 1);
+}
+#endif
@@ -13,6 +13,7 @@
 
 #include "debug.h"
 #include "interrupts.h"
+#include "local_spinlock.h"
 #include "memory.h"
 
 #include "apic_data.h"
@@ -21,10 +22,15 @@ typedef struct {
   uint32_t id;
   uint32_t global_intr_base;
   uint32_t volatile *base_addr;
+  int redir_cnt;
+  int *vectors; // vector each pin is routed to, -1 if unmapped
 } ioapic_t;
 
 static ioapic_t *ioapics;
 static int ioapic_cnt;
+// Index/window pairs are shared by every path that touches a redirection
+// entry, including hard irqs, so the lock is taken with interrupts off
+static int ioapic_lock = 0;
 
 static void ioapic_write(int idx, uint32_t off, uint32_t val) {
   ioapics[idx].base_addr[0] = off;
@@ -36,20 +42,39 @@ static uint32_t ioapic_read(int idx, uint32_t off) {
   return ioapics[idx].base_addr[4];
 }
 
+static void ioapic_setdest(uint32_t idx, uint32_t irq_pin, int apic_id) {
+  const uint32_t high_index = 0x10 + irq_pin * 2 + 1;
+
+  int state = cli();
+  local_spinlock_lock(&ioapic_lock);
+  uint32_t high = ioapic_read(idx, high_index);
+  high &= ~0xff000000;
+  high |= ((uint32_t)apic_id & 0xff) << 24;
+  ioapic_write(idx, high_index, high);
+  local_spinlock_unlock(&ioapic_lock);
+  sti(state);
+}
+
+// Move every pin routed to irq over to the new destination
+static void ioapic_retarget(int irq, int apic_id) {
+  for (int i = 0; i < ioapic_cnt; i++)
+    for (int j = 0; j < ioapics[i].redir_cnt; j++)
+      if (ioapics[i].vectors[j] == irq)
+        ioapic_setdest(i, j, apic_id);
+}
+
 static void ioapic_map(uint32_t idx, uint32_t irq_pin, uint32_t irq,
                        bool active_low, bool level_trigger) {
 
   // configure this override
   const uint32_t low_index = 0x10 + irq_pin * 2;
-  const uint32_t high_index = 0x10 + irq_pin * 2 + 1;
 
-  uint32_t high = ioapic_read(idx, high_index);
-  high &= ~0xff000000;
-  // high |= (0xff000000);
-  // bsp is the destination
-  high |= (interrupt_get_cpuidx() << 24);
-  ioapic_write(idx, high_index, high);
+  ioapics[idx].vectors[irq_pin] = irq & 0xff;
+  interrupt_setretarget(irq & 0xff, ioapic_retarget);
+  ioapic_setdest(idx, irq_pin, interrupt_gettarget(irq & 0xff));
 
+  int state = cli();
+  local_spinlock_lock(&ioapic_lock);
   uint32_t low = ioapic_read(idx, low_index);
 
   // set the polarity
@@ -75,11 +100,16 @@ static void ioapic_map(uint32_t idx, uint32_t irq_pin, uint32_t irq,
   low &= ~(1 << 16);
 
   ioapic_write(idx, low_index, low);
+  local_spinlock_unlock(&ioapic_lock);
+  sti(state);
 }
 
 static void ioapic_setmask(uint32_t idx, uint32_t irq_pin, bool mask) {
   // configure this override
   const uint32_t low_index = 0x10 + irq_pin * 2;
+
+  int state = cli();
+  local_spinlock_lock(&ioapic_lock);
   uint32_t low = ioapic_read(idx, low_index);
 
   // unmask the interrupt
@@ -88,35 +118,45 @@ static void ioapic_setmask(uint32_t idx, uint32_t irq_pin, bool mask) {
     low |= (1 << 16);
 
   ioapic_write(idx, low_index, low);
+  local_spinlock_unlock(&ioapic_lock);
+  sti(state);
 }
 
-void interrupt_mapinterrupt(uint32_t line, int irq, bool active_low,
-                            bool level_trig) {
+static int ioapic_findline(uint32_t line, uint32_t *pin) {
   int ioapic_idx = 0;
   uint32_t ioapic_close_intr_base = 0;
 
   for (int i = 0; i < ioapic_cnt; i++)
-    if (ioapics[i].global_intr_base < line &&
+    if (ioapics[i].global_intr_base <= line &&
         ioapics[i].global_intr_base > ioapic_close_intr_base) {
       ioapic_close_intr_base = ioapics[i].global_intr_base;
       ioapic_idx = i;
     }
 
-  ioapic_map(ioapic_idx, line, irq, active_low, level_trig);
+  *pin = line - ioapics[ioapic_idx].global_intr_base;
+  return ioapic_idx;
 }
 
-void interrupt_setmask(uint32_t line, bool mask) {
-  int ioapic_idx = 0;
-  uint32_t ioapic_close_intr_base = 0;
+void interrupt_mapinterrupt(uint32_t line, int irq, bool active_low,
+                            bool level_trig) {
+  uint32_t pin = 0;
+  int ioapic_idx = ioapic_findline(line, &pin);
+
+  ioapic_map(ioapic_idx, pin, irq, active_low, level_trig);
+}
 
+void interrupt_setvectormask(int irq, bool mask) {
   for (int i = 0; i < ioapic_cnt; i++)
-    if (ioapics[i].global_intr_base < line &&
-        ioapics[i].global_intr_base > ioapic_close_intr_base) {
-      ioapic_close_intr_base = ioapics[i].global_intr_base;
-      ioapic_idx = i;
-    }
+    for (int j = 0; j < ioapics[i].redir_cnt; j++)
+      if (ioapics[i].vectors[j] == irq)
+        ioapic_setmask(i, j, mask);
+}
+
+void interrupt_setmask(uint32_t line, bool mask) {
+  uint32_t pin = 0;
+  int ioapic_idx = ioapic_findline(line, &pin);
 
-  ioapic_setmask(ioapic_idx, line, mask);
+  ioapic_setmask(ioapic_idx, pin, mask);
 }
 
 void ioapic_init(void) {
@@ -138,6 +178,10 @@ void ioapic_init(void) {
 
     // Configure the detected overrides
     int available_redirs = (int)((ioapic_read(i, 0x01) >> 16) & 0xff) + 1;
+    ioapics[i].redir_cnt = available_redirs;
+    ioapics[i].vectors = malloc(sizeof(int) * available_redirs);
+    for (int j = 0; j < available_redirs; j++)
+      ioapics[i].vectors[j] = -1;
 
     for (int j = 0; j < available_redirs; j++) {
       ioapic_map(i, j, j + intr_base + 0x20, false, false);
@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "types.h"
+
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "thread.h"
+
+#define IDT_ENTRY_COUNT (256)
+
+// Each threaded irq gets its own kernel thread, woken by the hard irq
+typedef struct {
+  InterruptHandler quick;  // optional, runs in the hard irq
+  InterruptHandler thread; // runs on worker
+  InterruptMask mask;
+  thread_t *worker;
+  _Atomic bool pending;
+  _Atomic bool stop;
+  int irq;
+} threaded_irq_t;
+
+static threaded_irq_t *threaded_irqs[IDT_ENTRY_COUNT];
+static int threaded_lock = 0;
+static bool idle_wake[MAX_CPU_COUNT];
+
+bool deferred_pending(void);
+
+static void threaded_setmask(threaded_irq_t *desc, bool mask) {
+  if (desc->mask != NULL)
+    desc->mask(desc->irq, mask);
+  else
+    interrupt_setvectormask(desc->irq, mask);
+}
+
+// Hard irq half, silence the source and leave the work to the worker
+static void threaded_hardirq(int irq) {
+  threaded_irq_t *desc =
+      __atomic_load_n(&threaded_irqs[irq], __ATOMIC_ACQUIRE);
+  if (desc == NULL)
+    return;
+
+  if (desc->quick != NULL)
+    desc->quick(irq);
+
+  threaded_setmask(desc, true);
+  __atomic_store_n(&desc->pending, true, __ATOMIC_RELEASE);
+  thread_wake(desc->worker);
+}
+
+// Blocks until the hard irq fires, runs the handler and unmasks the source.
+// Unlike work queued on the receiving core, any core may run it.
+static void threaded_worker(void *arg) {
+  threaded_irq_t *desc = (threaded_irq_t *)arg;
+
+  // stop is only set once no hard irq can raise pending again, so a run
+  // raised before it is still seen and the source left unmasked
+  while (true) {
+    bool stop = __atomic_load_n(&desc->stop, __ATOMIC_ACQUIRE);
+    if (__atomic_exchange_n(&desc->pending, false, __ATOMIC_ACQUIRE)) {
+      desc->thread(desc->irq);
+      threaded_setmask(desc, false);
+      continue;
+    }
+    if (stop)
+      break;
+    thread_block();
+  }
+
+  // Wait out interrupt_unregisterthreaded's wakeup before going away
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&threaded_lock);
+  local_spinlock_unlock(&threaded_lock);
+  interrupt_lowerpriority(prio);
+  free(desc);
+}
+
+int interrupt_registerthreaded(int irq, InterruptHandler quick,
+                               InterruptHandler thread, InterruptMask mask,
+                               int priority) {
+  if (thread == NULL || priority < 0 || priority >= THREAD_PRIO_COUNT)
+    return -1;
+
+  threaded_irq_t *desc = malloc(sizeof(threaded_irq_t));
+  if (desc == NULL)
+    return -1;
+  desc->quick = quick;
+  desc->thread = thread;
+  desc->mask = mask;
+  desc->pending = false;
+  desc->stop = false;
+  desc->irq = irq;
+
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&threaded_lock);
+  bool taken = threaded_irqs[irq] != NULL;
+  if (!taken)
+    threaded_irqs[irq] = desc;
+  local_spinlock_unlock(&threaded_lock);
+  interrupt_lowerpriority(prio);
+
+  if (taken) {
+    free(desc);
+    return -1;
+  }
+
+  // Published before the handler is, so the hard irq always has a worker
+  desc->worker = thread_create("irq", threaded_worker, desc, priority);
+  if (desc->worker == NULL) {
+    __atomic_store_n(&threaded_irqs[irq], NULL, __ATOMIC_RELEASE);
+    free(desc);
+    return -1;
+  }
+
+  interrupt_registerhandler(irq, threaded_hardirq);
+  return 0;
+}
+
+void interrupt_unregisterthreaded(int irq) {
+  interrupt_unregisterhandler(irq, threaded_hardirq);
+  interrupt_quiesce();
+
+  // No hard irq can reach the descriptor now, the worker frees it on its
+  // way out once it has drained any pending run
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  local_spinlock_lock(&threaded_lock);
+  threaded_irq_t *desc = threaded_irqs[irq];
+  threaded_irqs[irq] = NULL;
+  if (desc != NULL) {
+    __atomic_store_n(&desc->stop, true, __ATOMIC_RELEASE);
+    thread_wake(desc->worker);
+  }
+  local_spinlock_unlock(&threaded_lock);
+  interrupt_lowerpriority(prio);
+}
+
+void interrupt_wakeidle(int cpunum) {
+  __atomic_store_n(&idle_wake[cpunum], true, __ATOMIC_RELEASE);
+}
+
+void interrupt_idle(void) {
+  interrupt_rundeferred();
+
+  // Only halt if nothing was raised since the check above, sti delays
+  // interrupts by one instruction so the wakeup can't be missed
+  cli();
+  int cpu = interrupt_get_cpunum();
+  if (!deferred_pending() &&
+      !__atomic_exchange_n(&idle_wake[cpu], false, __ATOMIC_ACQUIRE))
+    __asm__ volatile("sti\n\thlt");
+  else
+    sti(1);
+}
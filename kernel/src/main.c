@@ -21,8 +21,12 @@
 #include "memory.h"
 #include "pci.h"
 #include "smp.h"
+#include "thread.h"
 #include "timer.h"
 
+#define AP_STACK_SIZE (4096 * 4)
+#define AP_STACK_IDS (256)
+
 static void spurious_irq_handler(int int_num) { int_num = 0; }
 
 static void pagefault_handler(int int_num) {
@@ -59,15 +63,20 @@ void setup_core(void) {
   interrupt_registerhandler(pf_intr, pagefault_handler);
 
   acpi_intr_init(); // Initialize IOAPIC + LAPIC from acpi tables
-  ioapic_init();
   apic_init();
+  ioapic_init();
 
   sti(1); // Enable interrupts
+  interrupt_setcpuonline();
 
   fp_platform_init(); // Setup FPU
 
   timer_init(); // Setup Timers
+  smp_call_init();
+  thread_init();
+  interrupt_deferred_startworker();
   smp_init();   // Setup SMP
+  interrupt_balance_init();
 }
 
 SECTION(".entry_point") int32_t main(void *param, uint64_t magic) {
@@ -81,15 +90,39 @@ SECTION(".entry_point") int32_t main(void *param, uint64_t magic) {
   devices_load(); // register drivers for every available device
 
   print_str("Initialized\r\n");
-  while (true)
-    halt();
+
+#ifdef BENCHMARK
+  vmem_fb_benchmark();
+  vmem_dumpstats(NULL);
+  interrupt_benchmark();
+  interrupt_deferred_benchmark();
+  smp_call_benchmark();
+  interrupt_priority_benchmark();
+  timer_wheel_benchmark();
+  timer_tickless_benchmark();
+  clock_benchmark();
+  timepage_benchmark();
+  rtc_benchmark();
+  thread_benchmark();
+  thread_switch_benchmark();
+  interrupt_dumpstats();
+#endif
+  thread_idle();
   return 0;
 }
 
-SECTION(".tramp_handler") uint64_t tramp_stack = 0xffffffff80000000;
-void alloc_ap_stack(void) {
-  uint64_t stack = (uint64_t)malloc(4096 * 4);
-  tramp_stack = stack + 4096 * 4;
+// Bring-up stacks indexed by APIC id, each AP looks up its own in the
+// trampoline so they can all start at once
+SECTION(".tramp_handler") uint64_t ap_stacks[AP_STACK_IDS];
+bool alloc_ap_stack(uint32_t apic_id) {
+  if (apic_id >= AP_STACK_IDS)
+    return false;
+
+  uint64_t stack = (uint64_t)malloc(AP_STACK_SIZE);
+  if (stack == 0)
+    PANIC("AP stack allocation failure!");
+  ap_stacks[apic_id] = stack + AP_STACK_SIZE;
+  return true;
 }
 
 SECTION(".tramp_handler") void smp_bootstrap(void) {
@@ -98,10 +131,14 @@ SECTION(".tramp_handler") void smp_bootstrap(void) {
   gdt_init();
   idt_init();
   apic_init();
+  smp_checkin();
+  tsc_sync_ap();
 
   fp_platform_init();
 
   timer_mp_init();
+  thread_mp_init();
+  interrupt_deferred_startworker();
 
   smp_signalready();
   while (1)
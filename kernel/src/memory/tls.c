@@ -20,8 +20,9 @@ static uint64_t tls_alloc_off;
 
 void tls_init(void) {
   uint8_t *tls_block = bootstrap_malloc(TLS_SIZE);
+  // The allocator is shared, every core's block has the same layout, so APs
+  // coming up concurrently must not reset it
   tls_mem = NULL;
-  tls_alloc_off = 0;
   wrmsr(GS_BASE_MSR, (uint64_t)tls_block);
 }
 
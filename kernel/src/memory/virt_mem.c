@@ -6,12 +6,18 @@
  */
 #include "memory.h"
 
+#include "boot_info.h"
 #include "cpuid.h"
+#include "debug.h"
 #include "local_spinlock.h"
+#include "smp.h"
 #include "stdint.h"
 #include "stdlib.h"
 #include "string.h"
 #include "stddef.h"
+#include "thread.h"
+#include "timepage.h"
+#include "timer.h"
 #include "types.h"
 
 #define PRESENT (1ull << 0)
@@ -21,26 +27,66 @@
 #define WRITETHROUGH (1ull << 3)
 #define CACHEDISABLE (1ull << 4)
 #define WRITEBACK (0)
-#define WRITECOMPLETE (3ull << 3)
+
+//PAT index 4 is programmed as WC, selected through the PAT bit alone
+#define PAT_SMALL (1ull << 7)
+#define PAT_LARGE (1ull << 12)
 
 #define LARGEPAGE (1ull << 7)
 #define GLOBALPAGE (1ull << 8)
 #define NOEXEC (1ull << 63)
 #define ADDR_MASK (0x000ffffffffff000)
 
+//Live entry count of the child table, kept in the ignored bits of the entry pointing to it
+#define CNT_SHAMT (52)
+#define CNT_MASK (0x3ffull << CNT_SHAMT)
+#define ENT_GETCNT(e) (((e) & CNT_MASK) >> CNT_SHAMT)
+#define ENT_SETCNT(e, c) (((e) & ~CNT_MASK) | ((uint64_t)(c) << CNT_SHAMT))
+
 #define KERN_TOP_BASE (0xffffffff80000000)
 #define KERN_PHYSMAP_BASE (0xFFFF800000000000)
 #define KERN_PHYSMAP_BASE_UC (KERN_PHYSMAP_BASE + GiB(512))
 
+//Ranges remembered per lazily populated window
+#define LAZY_RANGE_COUNT (256)
+
+//Software translation cache, one entry per 2MiB region
+#define XLATE_CACHE_SIZE (16)
+#define XLATE_REGION_SZ (MiB(2))
+#define XLATE_VALID (1ull << 0)
+
 struct vmem {
     uint64_t ptable[256];
+    uint64_t ptable_bytes;  //memory held by page tables below the top level
     int flags;
     int lock;
 };
 
+typedef struct {
+    uint64_t tag;   //region base | XLATE_VALID
+    uint64_t pde;   //2MiB leaf entry, or entry pointing to the 4KiB table
+} xlate_ent_t;
+
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} lazy_range_t;
+
+//Part of the direct map populated on first use. Ranges already mapped are
+//found without taking any lock, so only the first use of a range maps it.
+typedef struct {
+    intptr_t base;
+    int perms;
+    int lock;
+    _Atomic int cnt;
+    lazy_range_t ranges[LAZY_RANGE_COUNT];
+} lazy_window_t;
+
 struct lcl_data {
     uintptr_t ktable;
     vmem_t *cur_vmem;
+    uint64_t xlate_gen;
+    xlate_ent_t xlate_cache[XLATE_CACHE_SIZE];
 };
 
 static uint64_t levels[] = {
@@ -74,6 +120,21 @@ static bool largepage_avail[] = {
 static TLS struct lcl_data *lcl;
 static vmem_t kmem;
 static size_t phys_map_sz;
+static lazy_window_t uc_window = {
+    .base = KERN_PHYSMAP_BASE_UC,
+    .perms = vmem_flags_kernel | vmem_flags_rw | vmem_flags_uncached,
+};
+static lazy_window_t wb_window = {
+    .base = KERN_PHYSMAP_BASE,
+    .perms = vmem_flags_kernel | vmem_flags_rw | vmem_flags_cachewriteback,
+};
+
+//Bumped whenever a mapping is removed, invalidates every cpu's translation cache
+static _Atomic uint64_t xlate_gen = 0;
+
+static intptr_t fb_virt = 0;
+static intptr_t fb_phys = 0;
+static size_t fb_sz = 0;
 
 static uint64_t kernel_vmalloc = (KERN_PHYSMAP_BASE_UC + GiB(512));
 
@@ -89,6 +150,87 @@ void vmem_vfree(intptr_t virt, size_t sz) {
         kernel_vmalloc -= sz;
 }
 
+static void vmem_setpat(void) {
+    //PWT/PCD select entries 0-3, the PAT bit selects entries 4-7
+    uint64_t pat = 0;
+    pat |= 0x6;                   //PAT0 WB
+    pat |= ((uint64_t)0x4) << 8;  //PAT1 WT
+    pat |= ((uint64_t)0x0) << 16; //PAT2 UC
+    pat |= ((uint64_t)0x0) << 24; //PAT3 UC
+    pat |= ((uint64_t)0x1) << 32; //PAT4 WC
+    pat |= ((uint64_t)0x4) << 40; //PAT5 WT
+    pat |= ((uint64_t)0x0) << 48; //PAT6 UC
+    pat |= ((uint64_t)0x0) << 56; //PAT7 UC
+    wrmsr(PAT_MSR, pat);
+}
+
+static void vmem_xlate_invalidate(void) {
+    for(int i = 0; i < XLATE_CACHE_SIZE; i++)
+        lcl->xlate_cache[i].tag = 0;
+    lcl->xlate_gen = xlate_gen;
+}
+
+static size_t vmem_physmap_size(void) {
+    BootInfo *b_info = get_bootinfo();
+
+    //Firmware tables and legacy regions always live below 4GiB
+    uint64_t top = GiB(4);
+    for(uint32_t i = 0; i < b_info->MemoryMapCount; i++) {
+        MemMap *ent = &b_info->MemoryMap[i];
+        if(ent->type != MemoryRegionType_Free &&
+           ent->type != MemoryRegionType_ACPIReclaimable &&
+           ent->type != MemoryRegionType_ACPINVS)
+            continue;
+
+        if(ent->addr + ent->len > top)
+            top = ent->addr + ent->len;
+    }
+
+    //Round to 1GiB so the map can be built entirely out of huge pages
+    top = ALIGN(top, GiB(1));
+    if(top > GiB(512)) {
+        print_str("Physical memory above 512GiB is not mapped.\r\n");
+        top = GiB(512);
+    }
+    return top;
+}
+
+static void vmem_reserve_toplevel(uint64_t virt) {
+    uint64_t idx = ((virt & masks[0]) >> shamts[0]) - 256;
+    if(kmem.ptable[idx] & PRESENT)
+        return;
+
+    uint64_t n_lv = pmem_allocpage();
+    if(n_lv == 0)
+        PANIC("Pagetable allocation failure!");
+
+    memset((uint64_t*)vmem_phystovirt(n_lv, KiB(4), vmem_flags_cachewriteback), 0, KiB(4));
+    kmem.ptable[idx] = (n_lv & ADDR_MASK) | PRESENT | WRITE | USER;
+    kmem.ptable_bytes += KiB(4);
+}
+
+//Map physical [0, len) at base with the largest pages alignment allows,
+//leaving out [hole, hole_end)
+static void vmem_map_around(intptr_t base, uint64_t len, int perms, uint64_t hole, uint64_t hole_end) {
+    uint64_t phys = 0;
+    while(phys < len) {
+        if(phys >= hole && phys < hole_end) {
+            phys = hole_end;
+            continue;
+        }
+
+        uint64_t lim = (phys < hole && hole < len) ? hole : len;
+        uint64_t sz = KiB(4);
+        if(phys % GiB(1) == 0 && lim - phys >= GiB(1))
+            sz = GiB(1);
+        else if(phys % MiB(2) == 0 && lim - phys >= MiB(2))
+            sz = MiB(2);
+
+        vmem_map(NULL, base + phys, phys, sz, perms, 0);
+        phys += sz;
+    }
+}
+
 int vmem_init(void) {
     //Enable No Execute bit
     wrmsr(EFER_MSR, rdmsr(EFER_MSR) | (1 << 11));
@@ -105,13 +247,7 @@ int vmem_init(void) {
     //Detect and enable 1GiB page support
     if(cpuinfo->hugepage) largepage_avail[1] = true;
 
-    //Setup PAT
-    uint64_t pat = 0;
-    pat |= 0x6;                   //PAT0 WB
-    pat |= ((uint64_t)0x4) << 8;  //PAT1 WT
-    pat |= ((uint64_t)0x0) << 16; //PAT2 UC
-    pat |= ((uint64_t)0x1) << 24;  //PAT3 WC
-    wrmsr(PAT_MSR, pat);
+    vmem_setpat();
 
     uintptr_t ktable_phys = pmem_allocpage();
     uint64_t *ktable = (uint64_t*)vmem_phystovirt(ktable_phys, KiB(4), vmem_flags_cachewriteback);
@@ -123,28 +259,58 @@ int vmem_init(void) {
     {
         kmem.flags = vmem_flags_kernel;
         kmem.lock = 0;
+        kmem.ptable_bytes = 0;
         memset(kmem.ptable, 0, sizeof(uint64_t) * 256);
     }
 
     lcl->cur_vmem = NULL;
+    vmem_xlate_invalidate();
 
     uint64_t cur_ptable = 0;
     __asm__ volatile("mov %%cr3, %0" : "=r"(cur_ptable) ::);
     uint64_t *cur_ptable_d = (uint64_t*)vmem_phystovirt(cur_ptable, KiB(4), vmem_flags_cachewriteback);
 
-    vmem_map(NULL, KERN_TOP_BASE, 0x0, GiB(2), vmem_flags_kernel | vmem_flags_rw | vmem_flags_exec | vmem_flags_cachewriteback, 0);
+    //The bootloader framebuffer is only mapped write-combining, so it is left
+    //out of the WB maps below instead of being aliased by them
+    BootInfo *b_info = get_bootinfo();
+    uint64_t fb_off = 0;
+    if(b_info->FramebufferAddress != 0) {
+        fb_off = b_info->FramebufferAddress % KiB(4);
+        uint64_t fb_len = (uint64_t)b_info->FramebufferPitch * b_info->FramebufferHeight + fb_off;
+
+        fb_phys = b_info->FramebufferAddress - fb_off;
+        fb_sz = PAGE_ALIGN(fb_len);
+    }
+
+    vmem_map_around(KERN_TOP_BASE, GiB(2), vmem_flags_kernel | vmem_flags_rw | vmem_flags_exec | vmem_flags_cachewriteback, fb_phys, fb_phys + fb_sz);
 
     //Setup full physical to virtual map to simplify later accesses
-    phys_map_sz = GiB(256);
+    //The UC window is only populated on demand, but its top level entry is
+    //created now so every core's copy of the kernel table shares it
+    phys_map_sz = vmem_physmap_size();
+    vmem_reserve_toplevel(KERN_PHYSMAP_BASE_UC);
+
+    print_str("Physmap Size: ");
+    print_uint64(phys_map_sz, BASE_HEX);
+    print_str("\r\n");
+
+    vmem_map_around(KERN_PHYSMAP_BASE, phys_map_sz, vmem_flags_kernel | vmem_flags_rw | vmem_flags_cachewriteback, fb_phys, fb_phys + fb_sz);
 
-    vmem_map(NULL, KERN_PHYSMAP_BASE, 0x0, phys_map_sz, vmem_flags_kernel | vmem_flags_rw | vmem_flags_cachewriteback, 0);
-    vmem_map(NULL, KERN_PHYSMAP_BASE_UC, 0x0, phys_map_sz, vmem_flags_kernel | vmem_flags_rw | vmem_flags_uncached, 0);
+    if(fb_sz != 0) {
+        fb_virt = vmem_vmalloc(fb_sz);
+        vmem_map(NULL, fb_virt, fb_phys, fb_sz, vmem_flags_kernel | vmem_flags_rw | vmem_flags_cachewritecomplete, 0);
+        fb_virt += fb_off;
+    }
 
     __asm__ volatile("mov %0, %%cr3" :: "r"(ktable_phys) :);
 
     return 0;
 }
 
+intptr_t vmem_getframebuffer(void) {
+    return fb_virt;
+}
+
 int vmem_mp_init(void) {
     //Enable No Execute bit
     wrmsr(EFER_MSR, rdmsr(EFER_MSR) | (1 << 11));
@@ -161,13 +327,7 @@ int vmem_mp_init(void) {
     //Detect and enable 1GiB page support
     if(cpuinfo->hugepage) largepage_avail[1] = true;
 
-    //Setup PAT
-    uint64_t pat = 0;
-    pat |= 0x6;                   //PAT0 WB
-    pat |= ((uint64_t)0x4) << 8;  //PAT1 WT
-    pat |= ((uint64_t)0x0) << 16; //PAT2 UC
-    pat |= ((uint64_t)0x1) << 24;  //PAT3 WC
-    wrmsr(PAT_MSR, pat);
+    vmem_setpat();
 
     uintptr_t ktable_phys = pmem_allocpage();
     uint64_t *ktable = (uint64_t*)vmem_phystovirt(ktable_phys, KiB(4), vmem_flags_cachewriteback);
@@ -175,6 +335,7 @@ int vmem_mp_init(void) {
 
     lcl->ktable = ktable_phys;
     lcl->cur_vmem = NULL;
+    vmem_xlate_invalidate();
 
     local_spinlock_lock(&kmem.lock);
     memcpy(ktable + 256, kmem.ptable, sizeof(uint64_t) * 256);
@@ -185,14 +346,14 @@ int vmem_mp_init(void) {
     return 0;
 }
 
-static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, int flags, int lv) {
+static int vmem_map_st(vmem_t *owner, uint64_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, int flags, int lv, int *added) {
     uint64_t mask = masks[lv];
     uint64_t shamt = shamts[lv];
     uint64_t sz = levels[lv];
 
     uint64_t idx = (virt & mask) >> shamt;
 
-    if(size % sz == 0 && largepage_avail[lv]) {
+    if(size % sz == 0 && virt % sz == 0 && phys % sz == 0 && largepage_avail[lv]) {
         uint64_t c_flags = 0;
         c_flags |= PRESENT;
 
@@ -207,7 +368,7 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
         else if(perms & vmem_flags_uncached)
             c_flags |= CACHEDISABLE;
         else if(perms & vmem_flags_cachewritecomplete)
-            c_flags |= WRITECOMPLETE;
+            c_flags |= (sz == KiB(4)) ? PAT_SMALL : PAT_LARGE;
         else if(perms & vmem_flags_cachewriteback)
             c_flags |= WRITEBACK;
 
@@ -219,12 +380,13 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
 
         while(size > 0) {
             if(idx >= 512)
-                return vmem_err_continue;//vmem_map_st(p_vm, p_vm, virt, phys, size, perms, flags, 0);
+                return vmem_err_continue;
 
             if(vm[idx] & PRESENT)
                 return vmem_err_alreadymapped;
 
             vm[idx] = (phys & ADDR_MASK) | c_flags;
+            (*added)++;
 
             phys += sz;
             virt += sz;
@@ -243,6 +405,8 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
 
                 memset((uint64_t*)vmem_phystovirt(n_lv, KiB(4), vmem_flags_cachewriteback), 0, KiB(4));
                 vm[idx] = (n_lv & ADDR_MASK) | PRESENT | WRITE | USER;
+                owner->ptable_bytes += KiB(4);
+                (*added)++;
             }
 
             if(vm[idx] & LARGEPAGE)
@@ -250,7 +414,10 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
 
             uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(n_lv, KiB(4), vmem_flags_cachewriteback);
 
-            int ret = vmem_map_st(p_vm, n_lv_d, virt, phys, size, perms, flags, lv + 1);
+            int n_added = 0;
+            int ret = vmem_map_st(owner, n_lv_d, virt, phys, size, perms, flags, lv + 1, &n_added);
+            if(lv > 0)
+                vm[idx] = ENT_SETCNT(vm[idx], ENT_GETCNT(vm[idx]) + n_added);
             if(ret != vmem_err_continue)
                 return ret;
 
@@ -270,45 +437,84 @@ static int vmem_map_st(uint64_t *p_vm, uint64_t *vm, intptr_t virt, intptr_t phy
     }
 }
 
-static int vmem_unmap_st(uint64_t *p_vt, uint64_t *vm, intptr_t virt, size_t size, int lv) {
+//Replace the large page at vm[idx] with a full table of the next smaller size
+static void vmem_split_st(vmem_t *owner, uint64_t *vm, uint64_t idx, int lv) {
+    uint64_t ent = vm[idx];
+    uint64_t base = (ent & ADDR_MASK) & ~(levels[lv] - 1);
+    uint64_t c_flags = ent & ~ADDR_MASK;
+
+    //The PAT bit moves from bit 12 to bit 7 once the entries become 4KiB pages
+    if(lv + 1 == 3) {
+        c_flags &= ~LARGEPAGE;
+        if(ent & PAT_LARGE)
+            c_flags |= PAT_SMALL;
+    } else if(ent & PAT_LARGE)
+        c_flags |= PAT_LARGE;
+
+    uint64_t n_lv = pmem_allocpage();
+    if(n_lv == 0)
+        PANIC("Pagetable allocation failure!");
+
+    uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(n_lv, KiB(4), vmem_flags_cachewriteback);
+    for(int i = 0; i < 512; i++)
+        n_lv_d[i] = (base + i * levels[lv + 1]) | c_flags;
+
+    vm[idx] = ENT_SETCNT((n_lv & ADDR_MASK) | PRESENT | WRITE | USER, 512);
+    owner->ptable_bytes += KiB(4);
+}
+
+//Emptied tables are chained through their first entry, which stays non-present,
+//and only freed once every core has flushed its paging structure caches
+static int vmem_unmap_st(vmem_t *owner, uint64_t *vm, intptr_t virt, size_t size, int lv, int *removed, uint64_t *freed) {
     uint64_t mask = masks[lv];
     uint64_t shamt = shamts[lv];
     uint64_t sz = levels[lv];
 
-
     while(size > 0) {
         uint64_t idx = (virt & mask) >> shamt;
         uint64_t lv_ent = vm[idx];
-        uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(lv_ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+
+        //Portion of the request that falls within this entry
+        uint64_t len = sz - (virt % sz);
+        if(len > size)
+            len = size;
 
         if(lv_ent & PRESENT) {
-            if(size >= sz && ( (lv_ent & LARGEPAGE) | (sz == KiB(4) ))) {
+            if(lv == 3 || (lv_ent & LARGEPAGE)) {
+                if(len < sz) {
+                    //Partially covered large page, split it and revisit the entry
+                    vmem_split_st(owner, vm, idx, lv);
+                    continue;
+                }
+
                 vm[idx] = 0;
-                size -= sz;
-                virt += sz;
-            } else if (size >= sz && (~lv_ent & LARGEPAGE)) {
-                //recurse lower
-                int err = vmem_unmap_st(p_vt, n_lv_d, virt, size, lv + 1);
+                (*removed)++;
+            } else {
+                uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(lv_ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+
+                int n_removed = 0;
+                int err = vmem_unmap_st(owner, n_lv_d, virt, len, lv + 1, &n_removed, freed);
+
+                //Top level entries are copied into every core's table, so they are never released
+                if(lv > 0) {
+                    uint64_t cnt = ENT_GETCNT(vm[idx]) - n_removed;
+                    if(cnt == 0) {
+                        vm[idx] = 0;
+                        n_lv_d[0] = *freed;
+                        *freed = lv_ent & ADDR_MASK;
+                        owner->ptable_bytes -= KiB(4);
+                        (*removed)++;
+                    } else
+                        vm[idx] = ENT_SETCNT(vm[idx], cnt);
+                }
+
                 if(err != 0)
                     return err;
-
-                //free the lower level when done
-                pmem_free(lv_ent & ADDR_MASK);
-
-            } else if(size < sz && (~lv_ent & LARGEPAGE)) {
-                //Recurse lower
-                return vmem_unmap_st(p_vt, n_lv_d, virt, size, lv + 1);
-            } else if(size < sz && (lv_ent & LARGEPAGE)) {
-                //unmap large page
-                //determine maximum size for unmapping desired portion
-                //map at determined size
-                PANIC("Unimplemented!");
             }
-        } else if(size >= sz) {
-            size -= sz;
-            virt += sz;
-        } else
-            return vmem_err_nomapping;
+        }
+
+        size -= len;
+        virt += len;
     }
 
     return 0;
@@ -317,6 +523,8 @@ static int vmem_unmap_st(uint64_t *p_vt, uint64_t *vm, intptr_t virt, size_t siz
 int vmem_map(vmem_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, int flags) {
     uint64_t *ptable = 0;
 
+    //lcl is per core, and the locks must not be held across a switch
+    preempt_disable();
     if(virt < 0) {
         //Add to kernel map
         local_spinlock_lock(&kmem.lock);
@@ -327,20 +535,30 @@ int vmem_map(vmem_t *vm, intptr_t virt, intptr_t phys, size_t size, int perms, i
         ptable = vm->ptable;
     }
 
-    int rVal = vmem_map_st(ptable, ptable, virt, phys, size, perms, flags, 0);
+    int added = 0;
+    int rVal = vmem_map_st(virt < 0 ? &kmem : vm, ptable, virt, phys, size, perms, flags, 0, &added);
     if (virt >= 0) local_spinlock_unlock(&vm->lock);
     else {
         uint64_t *p_table = (uint64_t*)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
         memcpy(p_table + 256, kmem.ptable, 256 * sizeof(uint64_t));
         local_spinlock_unlock(&kmem.lock);
     }
+    preempt_enable();
     return rVal;
 }
 
+static void vmem_flushtables(void *arg) {
+    arg = NULL;
+    uint64_t cr3 = 0;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3) ::);
+    __asm__ volatile("mov %0, %%cr3" :: "r"(cr3) : "memory");
+}
+
 int vmem_unmap(vmem_t *vm, intptr_t virt, size_t size) {
     uint64_t *ptable = 0;
-    size = 0;
+    vmem_t *owner = (virt < 0) ? &kmem : vm;
 
+    preempt_disable();
     if(virt < 0) {
         //Add to kernel map
         local_spinlock_lock(&kmem.lock);
@@ -351,7 +569,11 @@ int vmem_unmap(vmem_t *vm, intptr_t virt, size_t size) {
         ptable = vm->ptable;
     }
 
-    int rVal = vmem_unmap_st(ptable, ptable, virt, size, 0);
+    int removed = 0;
+    uint64_t freed = 0;
+    int rVal = vmem_unmap_st(owner, ptable, virt, size, 0, &removed, &freed);
+    xlate_gen++;
+
     if (virt >= 0) local_spinlock_unlock(&vm->lock);
     else {
         uint64_t *p_table = (uint64_t*)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
@@ -359,6 +581,19 @@ int vmem_unmap(vmem_t *vm, intptr_t virt, size_t size) {
         local_spinlock_unlock(&kmem.lock);
     }
 
+    //Every core shares the kernel half, and may have this address space
+    //active too, so all of them flush before the tables are reused
+    if(freed != 0) {
+        vmem_flushtables(NULL);
+        smp_call_function(vmem_flushtables, NULL, true);
+        while(freed != 0) {
+            uint64_t next = ((uint64_t*)vmem_phystovirt(freed, KiB(4), vmem_flags_cachewriteback))[0];
+            pmem_free(freed);
+            freed = next;
+        }
+    }
+    preempt_enable();
+
     return rVal;
 }
 
@@ -369,7 +604,14 @@ int vmem_create(vmem_t **vm_r) {
 
     vm->flags = vmem_flags_user;
     vm->lock = 0;
+    vm->ptable_bytes = 0;
     memset(vm->ptable, 0, 256 * sizeof(uint64_t));
+
+    //Every address space can read the clock without entering the kernel
+    intptr_t timepage = timepage_getphys();
+    if(timepage != 0)
+        vmem_map(vm, TIME_PAGE_ADDR, timepage, KiB(4), vmem_flags_read | vmem_flags_user | vmem_flags_cachewriteback, 0);
+
     *vm_r = vm;
 
     return 0;
@@ -395,6 +637,7 @@ static void vmem_savestate() {
 }
 
 int vmem_setactive(vmem_t *vm) {
+    preempt_disable();
     vmem_savestate();
 
     //copy state to ktable
@@ -404,14 +647,18 @@ int vmem_setactive(vmem_t *vm) {
     local_spinlock_unlock(&vm->lock);
 
     lcl->cur_vmem = vm;
+    vmem_xlate_invalidate();
     __asm__ volatile("mov %0, %%cr3" :: "r"(lcl->ktable) :);
+    preempt_enable();
 
     return 0;
 }
 
 int vmem_getactive(vmem_t **vm) {
+    preempt_disable();
     vmem_savestate();
     *vm = lcl->cur_vmem;
+    preempt_enable();
     return 0;
 }
 
@@ -420,6 +667,7 @@ int vmem_flush(intptr_t virt, size_t sz) {
     // Alternatively, every 'thread' has its own memory space, so changes don't affect other cores
     //Thus, kernel can be flushed once every task switch
 
+    preempt_disable();
     vmem_savestate();
 
     if(sz > GiB(1))
@@ -428,50 +676,214 @@ int vmem_flush(intptr_t virt, size_t sz) {
         for(size_t n = 0; n < sz; n += KiB(4), virt += KiB(4))
             __asm__ ("invlpg (%0)" :: "r"(virt) :);
     }
+    preempt_enable();
     return 0;
 }
 
-static int vmem_virttophys_st(uint64_t *pg, uint64_t virt, intptr_t *phys, int lv) {
-    uint64_t shamt = shamts[lv];
-    uint64_t mask = masks[lv];
+//Resolve the 2MiB region containing virt to its level 2 entry, walking the
+//tables only on a translation cache miss. 1GiB pages are split into the
+//equivalent 2MiB leaf so every hit is handled the same way.
+static int vmem_xlate_region(uint64_t virt, uint64_t *pde) {
+    if(lcl->xlate_gen != xlate_gen)
+        vmem_xlate_invalidate();
 
-    uint64_t idx = (virt & mask) >> shamt;
-    uint64_t ent = pg[idx];
+    uint64_t region = virt & ~(XLATE_REGION_SZ - 1);
+    int slot = (virt / XLATE_REGION_SZ) % XLATE_CACHE_SIZE;
 
-    if(ent & PRESENT) {
+    if(lcl->xlate_cache[slot].tag == (region | XLATE_VALID)) {
+        *pde = lcl->xlate_cache[slot].pde;
+        return 0;
+    }
 
-        if((ent & LARGEPAGE) && largepage_avail[lv]) {
-            *phys = (ent & ADDR_MASK) + (virt % levels[lv]);
-            return 0;
-        }
+    uint64_t *pg = (uint64_t*)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
+    uint64_t ent = 0;
+    for(int lv = 0; lv < 3; lv++) {
+        ent = pg[(virt & masks[lv]) >> shamts[lv]];
+        if(~ent & PRESENT)
+            return vmem_err_nomapping;
 
-        if(levels[lv] == KiB(4)) {
-            *phys = (ent & ADDR_MASK) + (virt % levels[lv]);
-            return 0;
+        if(ent & LARGEPAGE) {
+            //Clear PAT_LARGE out of the address and narrow 1GiB pages down to the region
+            uint64_t base = (ent & ADDR_MASK) & ~(levels[lv] - 1);
+            ent = (ent & ~ADDR_MASK) | (base + ((virt % levels[lv]) & ~(XLATE_REGION_SZ - 1)));
+            break;
         }
 
-        uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
-        return vmem_virttophys_st(n_lv_d, virt, phys, lv + 1);
-    } else
+        if(lv < 2)
+            pg = (uint64_t*)vmem_phystovirt(ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+    }
+
+    lcl->xlate_cache[slot].tag = region | XLATE_VALID;
+    lcl->xlate_cache[slot].pde = ent;
+    *pde = ent;
+    return 0;
+}
+
+static int vmem_virttophys_lcl(intptr_t virt, intptr_t *phys) {
+    uint64_t pde = 0;
+    if(vmem_xlate_region((uint64_t)virt, &pde) != 0)
         return -1;
+
+    if(pde & LARGEPAGE) {
+        *phys = (pde & ADDR_MASK) + (virt % XLATE_REGION_SZ);
+        return 0;
+    }
+
+    uint64_t *pt = (uint64_t*)vmem_phystovirt(pde & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+    uint64_t pte = pt[(virt & masks[3]) >> shamts[3]];
+    if(~pte & PRESENT)
+        return -1;
+
+    *phys = (pte & ADDR_MASK) + (virt % KiB(4));
+    return 0;
+}
+
+static int vmem_addrun(vmem_physrun_t *runs, int *run_cnt, int max_runs, uint64_t phys, uint64_t len) {
+    int cnt = *run_cnt;
+    if(cnt > 0 && (uint64_t)(runs[cnt - 1].phys + runs[cnt - 1].len) == phys) {
+        runs[cnt - 1].len += len;
+        return 0;
+    }
+
+    if(cnt >= max_runs)
+        return vmem_err_overflow;
+
+    runs[cnt].phys = phys;
+    runs[cnt].len = len;
+    *run_cnt = cnt + 1;
+    return 0;
 }
 
+static int vmem_virttophys_range_lcl(intptr_t virt, size_t sz, vmem_physrun_t *runs, int max_runs) {
+    uint64_t cur = (uint64_t)virt;
+    uint64_t left = sz;
+    int run_cnt = 0;
+
+    while(left > 0) {
+        uint64_t pde = 0;
+        if(vmem_xlate_region(cur, &pde) != 0)
+            return vmem_err_nomapping;
+
+        uint64_t region_left = MIN(XLATE_REGION_SZ - (cur % XLATE_REGION_SZ), left);
+
+        if(pde & LARGEPAGE) {
+            int err = vmem_addrun(runs, &run_cnt, max_runs, (pde & ADDR_MASK) + (cur % XLATE_REGION_SZ), region_left);
+            if(err != 0)
+                return err;
+
+            cur += region_left;
+            left -= region_left;
+            continue;
+        }
+
+        //Walk the 4KiB entries of this region directly, no further lookups needed
+        uint64_t *pt = (uint64_t*)vmem_phystovirt(pde & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+        while(region_left > 0) {
+            uint64_t pte = pt[(cur & masks[3]) >> shamts[3]];
+            if(~pte & PRESENT)
+                return vmem_err_nomapping;
+
+            uint64_t len = MIN(KiB(4) - (cur % KiB(4)), region_left);
+            int err = vmem_addrun(runs, &run_cnt, max_runs, (pte & ADDR_MASK) + (cur % KiB(4)), len);
+            if(err != 0)
+                return err;
+
+            cur += len;
+            left -= len;
+            region_left -= len;
+        }
+    }
+
+    return run_cnt;
+}
+
+//The translation cache is per core, stay on it for the whole lookup
 int vmem_virttophys(intptr_t virt, intptr_t *phys) {
-    uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(lcl->ktable, KiB(4), vmem_flags_cachewriteback);
-    return vmem_virttophys_st(n_lv_d, (uint64_t)virt, phys, 0);
+    preempt_disable();
+    int rVal = vmem_virttophys_lcl(virt, phys);
+    preempt_enable();
+    return rVal;
+}
+
+int vmem_virttophys_range(intptr_t virt, size_t sz, vmem_physrun_t *runs, int max_runs) {
+    preempt_disable();
+    int rVal = vmem_virttophys_range_lcl(virt, sz, runs, max_runs);
+    preempt_enable();
+    return rVal;
+}
+
+static bool vmem_lazy_find(lazy_window_t *w, uint64_t start, uint64_t end) {
+    int cnt = __atomic_load_n(&w->cnt, __ATOMIC_ACQUIRE);
+    for(int i = 0; i < cnt; i++)
+        if(w->ranges[i].start <= start && end <= w->ranges[i].end)
+            return true;
+    return false;
+}
+
+//Map the requested range into the window on first use. The first use must
+//not come from an interrupt handler, it takes the window and kernel map locks.
+static intptr_t vmem_phystovirt_lazy(lazy_window_t *w, intptr_t phys, size_t sz) {
+    uint64_t base = phys & ~(KiB(4) - 1);
+    uint64_t end = PAGE_ALIGN(phys + sz);
+    intptr_t tmp = 0;
+
+    if(vmem_lazy_find(w, base, end))
+        return phys + w->base;
+
+    //With interrupts off a handler on this core can't come in behind us
+    int state = cli();
+    local_spinlock_lock(&w->lock);
+    for(uint64_t pg = base; pg < end;) {
+        if(vmem_virttophys(pg + w->base, &tmp) == 0) {
+            pg += KiB(4);
+            continue;
+        }
+
+        uint64_t run_end = pg + KiB(4);
+        while(run_end < end && vmem_virttophys(run_end + w->base, &tmp) != 0)
+            run_end += KiB(4);
+
+        if(vmem_map(NULL, pg + w->base, pg, run_end - pg, w->perms, 0) != 0)
+            PANIC("Lazy window mapping failure!");
+        pg = run_end;
+    }
+
+    //Every range must be found lock-free from then on
+    int cnt = w->cnt;
+    if(cnt >= LAZY_RANGE_COUNT)
+        PANIC("Lazy window range table full!");
+    w->ranges[cnt].start = base;
+    w->ranges[cnt].end = end;
+    __atomic_store_n(&w->cnt, cnt + 1, __ATOMIC_RELEASE);
+    local_spinlock_unlock(&w->lock);
+    sti(state);
+
+    return phys + w->base;
 }
 
 intptr_t vmem_phystovirt(intptr_t phys, size_t sz, int flags) {
 
+    //The framebuffer is left out of the WB maps and must not get a UC alias,
+    //its one WC mapping is the only way to reach it
+    if(fb_virt != 0 && phys < (intptr_t)(fb_phys + fb_sz) && (intptr_t)(phys + sz) > fb_phys) {
+        if(phys < fb_phys || (phys + sz) > fb_phys + fb_sz)
+            PANIC("Mapping straddles the framebuffer!");
+        return (fb_virt - fb_virt % KiB(4)) + (phys - fb_phys);
+    }
+
     if(flags & vmem_flags_cachewriteback) {
         if(phys < (intptr_t)GiB(2) && (phys + sz) < (intptr_t)GiB(2))
             return (phys + KERN_TOP_BASE);
 
-        if(phys < (intptr_t)phys_map_sz && (phys + sz) < phys_map_sz)
+        if(phys < (intptr_t)phys_map_sz && (phys + sz) <= phys_map_sz)
             return (phys + KERN_PHYSMAP_BASE);
+
+        //Beyond the memory map, e.g. a 64-bit BAR, mapped on demand
+        if(phys >= 0 && (phys + sz) <= GiB(512))
+            return vmem_phystovirt_lazy(&wb_window, phys, sz);
     } else if(flags & vmem_flags_uncached) {
-        if(phys < (intptr_t)phys_map_sz && (phys + sz) < phys_map_sz)
-            return (phys + KERN_PHYSMAP_BASE_UC);
+        if(phys >= 0 && (phys + sz) <= GiB(512))
+            return vmem_phystovirt_lazy(&uc_window, phys, sz);
     }
 
 
@@ -479,4 +891,128 @@ intptr_t vmem_phystovirt(intptr_t phys, size_t sz, int flags) {
     DEBUG_PRINT(ltoa(phys, tmp, 16));
     PANIC("Invalid Address Detected!");
     return phys;
-}
\ No newline at end of file
+}
+
+static void vmem_stats_st(uint64_t *vm, int lv, int cnt, uint64_t *tables, uint64_t *entries, uint64_t *mismatched) {
+    for(int i = 0; i < cnt; i++) {
+        uint64_t ent = vm[i];
+        if(~ent & PRESENT)
+            continue;
+
+        entries[lv]++;
+        if(lv == 3 || (ent & LARGEPAGE))
+            continue;
+
+        uint64_t *n_lv_d = (uint64_t*)vmem_phystovirt(ent & ADDR_MASK, KiB(4), vmem_flags_cachewriteback);
+        tables[lv + 1]++;
+
+        if(lv > 0) {
+            uint64_t live = 0;
+            for(int j = 0; j < 512; j++)
+                if(n_lv_d[j] & PRESENT)
+                    live++;
+            if(live != ENT_GETCNT(ent))
+                (*mismatched)++;
+        }
+
+        vmem_stats_st(n_lv_d, lv + 1, 512, tables, entries, mismatched);
+    }
+}
+
+void vmem_dumpstats(vmem_t *vm) {
+    uint64_t tables[4] = {0};
+    uint64_t entries[4] = {0};
+    uint64_t mismatched = 0;
+
+    if(vm == NULL)
+        vm = &kmem;
+
+    local_spinlock_lock(&vm->lock);
+    vmem_stats_st(vm->ptable, 0, 256, tables, entries, &mismatched);
+    uint64_t ptable_bytes = vm->ptable_bytes;
+    local_spinlock_unlock(&vm->lock);
+
+    print_str("Pagetable Bytes: ");
+    print_uint64(ptable_bytes, BASE_HEX);
+    print_str("\r\n");
+
+    for(int lv = 0; lv < 4; lv++) {
+        print_str("  L");
+        print_uint64(4 - lv, BASE_HEX);
+        print_str(" Tables: ");
+        print_uint64(tables[lv], BASE_HEX);
+        print_str(" Entries: ");
+        print_uint64(entries[lv], BASE_HEX);
+        print_str("\r\n");
+    }
+
+    if(mismatched != 0) {
+        print_str("  Mismatched Entry Counts: ");
+        print_uint64(mismatched, BASE_HEX);
+        print_str("\r\n");
+    }
+}
+
+#ifdef BENCHMARK
+#define FB_BENCH_SRC (KiB(64) / sizeof(uint64_t))
+
+static uint64_t fb_bench_src[FB_BENCH_SRC];
+
+static uint64_t vmem_fb_fill(volatile uint64_t *fb, size_t sz) {
+    uint64_t start = rdtsc();
+    for(size_t i = 0; i < sz / sizeof(uint64_t); i++)
+        fb[i] = i;
+    __asm__ volatile("sfence" ::: "memory");
+    return rdtsc() - start;
+}
+
+static uint64_t vmem_fb_blit(volatile uint64_t *fb, size_t sz) {
+    uint64_t start = rdtsc();
+    for(size_t i = 0; i < sz / sizeof(uint64_t); i++)
+        fb[i] = fb_bench_src[i % FB_BENCH_SRC];
+    __asm__ volatile("sfence" ::: "memory");
+    return rdtsc() - start;
+}
+
+//Swap the framebuffer's only mapping over to the given cache mode in place
+static void vmem_fb_remap(intptr_t virt, int cache) {
+    vmem_unmap(NULL, virt, fb_sz);
+    vmem_flush(virt, fb_sz);
+    smp_call_function(vmem_flushtables, NULL, true);
+    vmem_map(NULL, virt, fb_phys, fb_sz, vmem_flags_kernel | vmem_flags_rw | cache, 0);
+    vmem_flush(virt, fb_sz);
+}
+
+void vmem_fb_benchmark(void) {
+    if(fb_virt == 0) {
+        print_str("FB Benchmark: no framebuffer\r\n");
+        return;
+    }
+
+    intptr_t virt = fb_virt - fb_virt % KiB(4);
+    size_t len = fb_sz - fb_virt % KiB(4);
+    for(size_t i = 0; i < FB_BENCH_SRC; i++)
+        fb_bench_src[i] = ~i;
+
+    uint64_t wc_fill = vmem_fb_fill((volatile uint64_t*)fb_virt, len);
+    uint64_t wc_blit = vmem_fb_blit((volatile uint64_t*)fb_virt, len);
+
+    //Same pages as UC for comparison, never mapped both ways at once
+    vmem_fb_remap(virt, vmem_flags_uncached);
+    uint64_t uc_fill = vmem_fb_fill((volatile uint64_t*)fb_virt, len);
+    uint64_t uc_blit = vmem_fb_blit((volatile uint64_t*)fb_virt, len);
+    vmem_fb_remap(virt, vmem_flags_cachewritecomplete);
+
+    print_str("FB Benchmark bytes: ");
+    print_uint64(len, BASE_HEX);
+    print_str("\r\n  WC fill cycles: ");
+    print_uint64(wc_fill, BASE_HEX);
+    print_str(" blit cycles: ");
+    print_uint64(wc_blit, BASE_HEX);
+    print_str("\r\n  UC fill cycles: ");
+    print_uint64(uc_fill, BASE_HEX);
+    print_str(" blit cycles: ");
+    print_uint64(uc_blit, BASE_HEX);
+    print_str("\r\n");
+}
+#endif
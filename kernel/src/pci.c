@@ -13,11 +13,25 @@
 
 #include "acpi/mcfg.h"
 #include "acpi/tables.h"
+#include "interrupts.h"
+#include "local_spinlock.h"
 #include "memory.h"
 #include "pci.h"
 
 #define PCI_ADDR 0xCF8
 #define PCI_DATA 0xCFC
+#define PCI_MSIX_MAPS 64
+
+// MSI-X tables mapped when their vectors are set up, so masking an entry
+// from a hard irq only looks the mapping up
+typedef struct {
+  pci_config_t *device;
+  volatile uint32_t *table; // MMIO
+} pci_msix_map_t;
+
+static pci_msix_map_t msix_maps[PCI_MSIX_MAPS];
+static _Atomic int msix_map_cnt = 0;
+static int msix_map_lock = 0;
 
 static pci_device_t *device_set;
 static int device_count;
@@ -132,6 +146,61 @@ int pci_getmsiinfo(pci_config_t *device, int *cnt) {
   return -1;
 }
 
+static pci_msix_t *pci_findmsix(pci_config_t *device) {
+  if (device->capabilitiesPtr == 0)
+    return NULL;
+
+  uint8_t ptr = device->capabilitiesPtr;
+  uint8_t *pci_base = (uint8_t *)device;
+  do {
+    pci_cap_header_t *capEntry = (pci_cap_header_t *)(pci_base + ptr);
+    if (capEntry->capID == pci_cap_msix)
+      return (pci_msix_t *)capEntry;
+    ptr = capEntry->nextPtr;
+  } while (ptr != 0);
+
+  return NULL;
+}
+
+static volatile uint32_t *pci_msix_findtable(pci_config_t *device) {
+  int cnt = __atomic_load_n(&msix_map_cnt, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < cnt; i++)
+    if (msix_maps[i].device == device)
+      return msix_maps[i].table;
+  return NULL;
+}
+
+// Map the whole MSI-X table once, large tables span more than one page
+static volatile uint32_t *pci_msix_gettable(pci_config_t *device, pci_msix_t *msix) {
+  volatile uint32_t *table = pci_msix_findtable(device);
+  if (table != NULL)
+    return table;
+
+  uint64_t bar = pci_parsebar(device, msix->table_off.bir);
+  size_t table_sz = (msix->ctrl.table_sz + 1) * 16;
+  table = (volatile uint32_t *)vmem_phystovirt(
+      (intptr_t)(bar + (msix->table_off.offset << 3)), table_sz,
+      vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+
+  int state = cli();
+  local_spinlock_lock(&msix_map_lock);
+  int cnt = msix_map_cnt;
+  if (pci_msix_findtable(device) == NULL) {
+    // pci_msix_setmask could never find an unrecorded table
+    if (cnt >= PCI_MSIX_MAPS) {
+      local_spinlock_unlock(&msix_map_lock);
+      sti(state);
+      PANIC("Too many MSI-X tables!");
+    }
+    msix_maps[cnt].device = device;
+    msix_maps[cnt].table = table;
+    __atomic_store_n(&msix_map_cnt, cnt + 1, __ATOMIC_RELEASE);
+  }
+  local_spinlock_unlock(&msix_map_lock);
+  sti(state);
+  return table;
+}
+
 int pci_setmsiinfo(pci_config_t *device, int msix, uintptr_t *msi_addr,
                    uint32_t *msi_msg, int cnt) {
   // Search cap list
@@ -168,28 +237,21 @@ int pci_setmsiinfo(pci_config_t *device, int msix, uintptr_t *msi_addr,
       } else if (capEntry->capID == pci_cap_msix && msix == 1) {
 
         pci_msix_t *msi_space = (pci_msix_t *)capEntry;
+        int entries = msi_space->ctrl.table_sz + 1;
 
-        if (cnt != 1 && (msi_space->ctrl.table_sz + 1) != cnt)
+        // A single message is shared by every entry, otherwise the first cnt
+        // entries are programmed and the rest stay masked
+        if (cnt > entries)
           return -1;
 
-        // get the specified bar, get its virtual address
-        uint64_t bar = 0;
-        for (int i = 0; i < 6; i++) {
-          if ((device->bar[i] & 0x6) == 0x4) // Is 64-bit
-            bar = (device->bar[i] & 0xFFFFFFF0) +
-                  ((uint64_t)device->bar[i + 1] << 32);
-          else if ((device->bar[i] & 0x6) == 0x0) // Is 32-bit
-            bar = (device->bar[i] & 0xFFFFFFF0);
-          if (i == msi_space->table_off.bir)
-            break;
-        }
-
-        uint32_t *table = (uint32_t *)vmem_phystovirt(
-            (intptr_t)(bar + (msi_space->table_off.offset << 3)), KiB(4),
-            vmem_flags_uncached | vmem_flags_kernel | vmem_flags_rw);
+        volatile uint32_t *table = pci_msix_gettable(device, msi_space);
 
         // fill the offset table
-        for (int i = 0; i <= msi_space->ctrl.table_sz; i++) {
+        for (int i = 0; i < entries; i++) {
+          if (cnt != 1 && i >= cnt) {
+            table[i * 4 + 3] |= 1;
+            continue;
+          }
           table[i * 4 + 0] = (uint32_t)msi_addr[cnt == 1 ? 0 : i];
           table[i * 4 + 1] = (uint32_t)(msi_addr[cnt == 1 ? 0 : i] >> 32);
           table[i * 4 + 2] = msi_msg[cnt == 1 ? 0 : i];
@@ -198,7 +260,6 @@ int pci_setmsiinfo(pci_config_t *device, int msix, uintptr_t *msi_addr,
 
         msi_space->ctrl.func_mask = 0;
         msi_space->ctrl.enable = 1;
-        //__asm__("cli\n\thlt" :: "a"(table));
       }
       ptr = capEntry->nextPtr;
     } while (ptr != 0);
@@ -207,6 +268,85 @@ int pci_setmsiinfo(pci_config_t *device, int msix, uintptr_t *msi_addr,
   return 0;
 }
 
+static int pci_msix_nextcpu(uint64_t cpu_mask, int cpu) {
+  do {
+    cpu = (cpu + 1) % MAX_CPU_COUNT;
+  } while ((cpu_mask & (1ull << cpu)) == 0);
+  return cpu;
+}
+
+int pci_msix_allocate(pci_config_t *device, int cnt, uint64_t cpu_mask,
+                      InterruptHandler handler, int *vectors, int *cpus) {
+  pci_msix_t *msix = pci_findmsix(device);
+  if (msix == NULL || cnt <= 0 || cnt > msix->ctrl.table_sz + 1)
+    return -1;
+
+  // Offline cores have no apic id yet, their vectors would land on apic 0
+  if (cpu_mask == 0)
+    cpu_mask = interrupt_getonlinemask();
+  cpu_mask &= interrupt_getonlinemask();
+  if (cpu_mask == 0)
+    return -1;
+
+  // Take every vector before touching the device, so a failure leaves it as
+  // it was. Entries are spread round robin over the requested cores, each
+  // core handing out vectors from its own space.
+  int cpu = -1;
+  for (int i = 0; i < cnt; i++) {
+    cpu = pci_msix_nextcpu(cpu_mask, cpu);
+    if (interrupt_allocate_local(cpu, 1, interrupt_flags_none, &vectors[i]) !=
+        0) {
+      cpu = -1;
+      for (int j = 0; j < i; j++) {
+        cpu = pci_msix_nextcpu(cpu_mask, cpu);
+        interrupt_free_local(cpu, vectors[j], 1);
+      }
+      return -1;
+    }
+  }
+
+  volatile uint32_t *table = pci_msix_gettable(device, msix);
+
+  // Hold off delivery while the table is rewritten
+  msix->ctrl.func_mask = 1;
+  for (int i = 0; i <= msix->ctrl.table_sz; i++)
+    table[i * 4 + 3] |= 1;
+
+  cpu = -1;
+  for (int i = 0; i < cnt; i++) {
+    cpu = pci_msix_nextcpu(cpu_mask, cpu);
+    interrupt_registerhandler_local(cpu, vectors[i], handler);
+
+    table[i * 4 + 0] = msi_register_addr(interrupt_get_apicid(cpu));
+    table[i * 4 + 1] = 0;
+    table[i * 4 + 2] = (uint32_t)msi_register_data(vectors[i]);
+    table[i * 4 + 3] &= ~1;
+
+    if (cpus != NULL)
+      cpus[i] = cpu;
+  }
+
+  msix->ctrl.enable = 1;
+  msix->ctrl.func_mask = 0;
+  return 0;
+}
+
+int pci_msix_setmask(pci_config_t *device, int entry, bool mask) {
+  pci_msix_t *msix = pci_findmsix(device);
+  if (msix == NULL || entry < 0 || entry > msix->ctrl.table_sz)
+    return -1;
+
+  // Callable from a hard irq, the table was mapped along with its vectors
+  volatile uint32_t *table = pci_msix_findtable(device);
+  if (table == NULL)
+    return -1;
+  if (mask)
+    table[entry * 4 + 3] |= 1;
+  else
+    table[entry * 4 + 3] &= ~1;
+  return 0;
+}
+
 int get_pcidevice_count() { return device_count; }
 
 pci_device_t *get_pcidevice(int idx) { return &device_set[idx]; }
@@ -8,8 +8,10 @@
 #include "smp.h"
 #include "apic_data.h"
 #include "cpuid.h"
+#include "debug.h"
 #include "interrupts.h"
 #include "types.h"
+#include "thread.h"
 #include "timer.h"
 #include "stdlib.h"
 #include "string.h"
@@ -18,34 +20,230 @@
 #define TLS_SIZE ((int)KiB(16))
 #define GS_BASE_MSR (0xC0000101)
 #define KERNEL_GS_BASE_MSR (0xC0000102)
+#define SMP_CALL_POOL (64)  //async calls in flight per sending core
+#define SMP_CHECKIN_TIMEOUT_NS (100 * 1000 * 1000ull)
+#define SMP_READY_TIMEOUT_NS (1000 * 1000 * 1000ull)
 
 static int smp_loc = 0;
 static _Atomic volatile int pos = 0;
 static TLS uint64_t* g_tls;
 static _Atomic int coreCount = 1;
-static _Atomic volatile int core_ready = 0;
+static uint32_t ap_ids[MAX_CPU_COUNT];
 
-void alloc_ap_stack(void);
+//APs check in once they can serve the BSP, after the timeout the door closes
+static int checkin_lock = 0;
+static bool checkin_closed = false;
+static _Atomic uint64_t checkin_mask = 0;
+
+typedef struct smp_call {
+    struct smp_call *next;
+    void (*func)(void*);
+    void *arg;
+    _Atomic int *pending;   //decremented once func returns, NULL for async calls
+    _Atomic bool busy;      //async pool slot in use, cleared by the callee
+} smp_call_t;
+
+//Lock-free multi-producer mailbox, the owning core takes the whole list at once
+typedef struct {
+    smp_call_t *head;
+} ALIGNED(64) smp_mailbox_t;
+
+static smp_mailbox_t mailboxes[MAX_CPU_COUNT];
+static smp_call_t call_pool[MAX_CPU_COUNT][SMP_CALL_POOL];
+static int smp_call_vector = 0;
+
+bool alloc_ap_stack(uint32_t apic_id);
 
 void smp_init(void) {
-    //Start initializing the APs
-    uint64_t ap_cnt = get_lapic_count();
+    uint64_t lapic_cnt = get_lapic_count();
+    int ap_cnt = 0;
 
-    for(uint32_t i = 0; i < ap_cnt; i++) {
+    //Publish every AP's stack before starting any of them
+    for(uint32_t i = 0; i < lapic_cnt && ap_cnt < MAX_CPU_COUNT - 1; i++) {
         uint64_t apic_id = get_lapic_info(i)->apic_id;
 
-        if((int)apic_id != interrupt_get_cpuidx()) {
-            core_ready = 0;
+        if((int)apic_id == interrupt_get_cpuidx())
+            continue;
+
+        if(!alloc_ap_stack(apic_id)) {
+            print_str("APIC id out of trampoline range, core skipped.\r\n");
+            continue;
+        }
+        ap_ids[ap_cnt++] = apic_id;
+    }
+
+    //One INIT-SIPI-SIPI round for all of them, sent per core so cores missing
+    //from the MADT stay parked
+    for(int i = 0; i < ap_cnt; i++)
+        interrupt_sendipi(ap_ids[i], 0x0, ipi_delivery_mode_init);
+    msleep(10);
+
+    for(int sipi = 0; sipi < 2; sipi++) {
+        for(int i = 0; i < ap_cnt; i++)
+            interrupt_sendipi(ap_ids[i], 0x0f, ipi_delivery_mode_startup);
+        udelay(200);
+    }
+
+    //Cores that haven't checked in by the deadline are left out for good
+    uint64_t deadline = clock_monotonic_ns() + SMP_CHECKIN_TIMEOUT_NS;
+    while(__builtin_popcountll(checkin_mask) < ap_cnt && clock_monotonic_ns() < deadline)
+        __asm__ volatile("pause");
+
+    local_spinlock_lock(&checkin_lock);
+    checkin_closed = true;
+    uint64_t arrived = checkin_mask;
+    local_spinlock_unlock(&checkin_lock);
+
+    int arrived_cnt = __builtin_popcountll(arrived);
+    if(arrived_cnt < ap_cnt) {
+        print_int32(ap_cnt - arrived_cnt, BASE_HEX);
+        print_str(" cores failed to start, continuing without them.\r\n");
+    }
+
+    tsc_sync_bsp(arrived);
+
+    //The rest of bring up runs on all the APs in parallel
+    deadline = clock_monotonic_ns() + SMP_READY_TIMEOUT_NS;
+    while(coreCount < arrived_cnt + 1 && clock_monotonic_ns() < deadline)
+        __asm__ volatile("pause");
+    if(coreCount < arrived_cnt + 1)
+        print_str("Cores stalled during bring up, continuing without them.\r\n");
+}
+
+void smp_checkin(void) {
+    local_spinlock_lock(&checkin_lock);
+    bool closed = checkin_closed;
+    if(!closed)
+        checkin_mask |= 1ull << interrupt_get_cpunum();
+    local_spinlock_unlock(&checkin_lock);
+
+    //Too late, the BSP has moved on without this core
+    while(closed)
+        __asm__ volatile("cli\n\thlt");
+}
+
+static void smp_call_drain(void) {
+    smp_mailbox_t *mbox = &mailboxes[interrupt_get_cpunum()];
+    smp_call_t *list = __atomic_exchange_n(&mbox->head, NULL, __ATOMIC_ACQUIRE);
+
+    //Entries were pushed LIFO, reverse them so calls run in the order they were made
+    smp_call_t *ordered = NULL;
+    while(list != NULL) {
+        smp_call_t *next = list->next;
+        list->next = ordered;
+        ordered = list;
+        list = next;
+    }
+
+    while(ordered != NULL) {
+        smp_call_t *call = ordered;
+        ordered = call->next;
+
+        call->func(call->arg);
+        if(call->pending != NULL)
+            __atomic_fetch_sub(call->pending, 1, __ATOMIC_RELEASE);
+        else
+            __atomic_store_n(&call->busy, false, __ATOMIC_RELEASE);
+    }
+}
+
+static void smp_call_handler(int irq) {
+    irq = 0;
+    smp_call_drain();
+}
+
+void smp_call_init(void) {
+    smp_call_vector = 0xF0;
+    if(interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_ipi, &smp_call_vector) != 0)
+        PANIC("Failed to allocate cross call vector.");
+    interrupt_registerhandler(smp_call_vector, smp_call_handler);
+}
+
+//Returns true if the mailbox was empty, in which case the caller owes it an IPI
+static bool smp_call_push(int cpu, smp_call_t *call) {
+    smp_mailbox_t *mbox = &mailboxes[cpu];
+    smp_call_t *head = __atomic_load_n(&mbox->head, __ATOMIC_RELAXED);
+    do {
+        call->next = head;
+    } while(!__atomic_compare_exchange_n(&mbox->head, &head, call, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return head == NULL;
+}
+
+//Take a free slot from the calling core's async pool, servicing our own
+//mailbox while they are all in flight so two cores can't starve each other
+static smp_call_t *smp_call_getslot(int self) {
+    smp_call_t *pool = call_pool[self];
+    while(true) {
+        for(int i = 0; i < SMP_CALL_POOL; i++)
+            if(!__atomic_load_n(&pool[i].busy, __ATOMIC_RELAXED) &&
+               !__atomic_exchange_n(&pool[i].busy, true, __ATOMIC_ACQUIRE))
+                return &pool[i];
+
+        if(__atomic_load_n(&mailboxes[self].head, __ATOMIC_RELAXED) != NULL) {
+            int state = cli();
+            smp_call_drain();
+            sti(state);
+        }
+        __asm__ volatile("pause");
+    }
+}
+
+void smp_call_function_mask(uint64_t mask, void (*func)(void*), void *arg, bool wait) {
+    smp_call_t calls[MAX_CPU_COUNT];
+    _Atomic int pending = 0;
+    uint64_t ipi_mask = 0;
 
-            alloc_ap_stack();
-            interrupt_sendipi(apic_id, 0x0, ipi_delivery_mode_init);
+    //self and its mailbox must stay ours until every call is queued and done
+    preempt_disable();
+    int self = interrupt_get_cpunum();
+
+    mask &= interrupt_getonlinemask();
+    bool run_self = (mask & (1ull << self)) != 0;
+    mask &= ~(1ull << self);
+
+    for(int i = 0; i < MAX_CPU_COUNT; i++) {
+        if((mask & (1ull << i)) == 0)
+            continue;
+
+        smp_call_t *call = wait ? &calls[i] : smp_call_getslot(self);
+        call->func = func;
+        call->arg = arg;
+        call->pending = wait ? &pending : NULL;
+        if(wait)
+            pending++;
+
+        if(smp_call_push(i, call))
+            ipi_mask |= (1ull << i);
+    }
+
+    interrupt_sendipi_mask(ipi_mask, smp_call_vector);
+
+    if(run_self) {
+        int state = cli();
+        func(arg);
+        sti(state);
+    }
 
-            //Use the timer api to wait for 10ms
-            timer_wait(10 * 1000 * 1000);
-            interrupt_sendipi(apic_id, 0x0f, ipi_delivery_mode_startup);
-            while(!core_ready);
+    //Keep servicing our own mailbox so two cores calling each other can't deadlock
+    while(wait && __atomic_load_n(&pending, __ATOMIC_ACQUIRE) != 0) {
+        if(__atomic_load_n(&mailboxes[self].head, __ATOMIC_RELAXED) != NULL) {
+            int state = cli();
+            smp_call_drain();
+            sti(state);
         }
+        __asm__ volatile("pause");
     }
+    preempt_enable();
+}
+
+void smp_call_function_single(int cpu, void (*func)(void*), void *arg, bool wait) {
+    smp_call_function_mask(1ull << cpu, func, arg, wait);
+}
+
+void smp_call_function(void (*func)(void*), void *arg, bool wait) {
+    preempt_disable();
+    smp_call_function_mask(~(1ull << interrupt_get_cpunum()), func, arg, wait);
+    preempt_enable();
 }
 
 int smp_corecount(void) {
@@ -54,11 +252,16 @@ int smp_corecount(void) {
 
 void smp_signalready(void) {
 
-    coreCount++;
     print_str("Core Registered.\r\n");
-    core_ready = 1;
-    while(true)
-        ;
+    coreCount++;
+
+    //Idle with interrupts enabled so device interrupts can be routed here
+    sti(1);
+    interrupt_setcpuonline();
+#ifdef BENCHMARK
+    interrupt_benchmark_ap();
+#endif
+    thread_idle();
 }
 
 int smp_platform_getstatesize(void) {
@@ -94,4 +297,34 @@ void smp_platform_getdefaultstate(void *buf, void *stackpointer, void *instr_ptr
     regs->rip = (uint64_t)instr_ptr;
 
     regs->rdi = (uint64_t)args;
-}
\ No newline at end of file
+}
+#ifdef BENCHMARK
+#define SMP_CALL_BENCH_ITERS (10000)
+
+static void smp_call_bench_nop(void *arg) {
+    arg = NULL;
+}
+
+void smp_call_benchmark(void) {
+    uint64_t others = interrupt_getonlinemask() & ~(1ull << interrupt_get_cpunum());
+    if(others == 0)
+        return;
+
+    int target = __builtin_ctzll(others);
+    uint64_t start = rdtsc();
+    for(int i = 0; i < SMP_CALL_BENCH_ITERS; i++)
+        smp_call_function_single(target, smp_call_bench_nop, NULL, true);
+    uint64_t single = (rdtsc() - start) / SMP_CALL_BENCH_ITERS;
+
+    start = rdtsc();
+    for(int i = 0; i < SMP_CALL_BENCH_ITERS; i++)
+        smp_call_function(smp_call_bench_nop, NULL, true);
+    uint64_t bcast = (rdtsc() - start) / SMP_CALL_BENCH_ITERS;
+
+    print_str("Cross call round trip cycles: ");
+    print_uint64(single, BASE_HEX);
+    print_str(" Broadcast: ");
+    print_uint64(bcast, BASE_HEX);
+    print_str("\r\n");
+}
+#endif
@@ -1,8 +1,658 @@
 /**
  * Copyright (c) 2019 Himanshu Goel
- * 
+ *
  * This software is released under the MIT License.
  * https://opensource.org/licenses/MIT
  */
 
+#include "stddef.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "types.h"
+
+#include "debug.h"
+#include "fpu.h"
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "smp.h"
 #include "thread.h"
+#include "timer.h"
+
+#define THREAD_STACK_SIZE (KiB(16))
+#define THREAD_SLICE_NS (1000 * 1000)
+#define THREAD_SLICE_SLACK_NS (100 * 1000)
+#define THREAD_RETRY_NS (100 * 1000) // a held off switch is tried again after
+#define THREAD_YIELD_VEC (0x80)
+#define THREAD_NM_VEC (0x07)
+
+// Per-core run queue, one FIFO per priority. Only the owning core runs
+// threads from it, other cores take the lock to push or steal.
+typedef struct {
+  int lock;
+  uint32_t bitmap; // bit p set while queue p is non-empty
+  thread_t *heads[THREAD_PRIO_COUNT];
+  thread_t *tails[THREAD_PRIO_COUNT];
+  _Atomic int queued;
+
+  thread_t *cur;
+  thread_t *prev; // switched out, requeued once its stack is left
+  bool need_resched;
+  soft_timer_t slice;
+  thread_t idle; // the core's boot context
+
+  thread_t *fpu_last; // whose state the FPU registers hold
+  bool fpu_trap;      // CR0.TS is set
+
+  uint64_t switches;
+  uint64_t steals;
+} ALIGNED(64) runqueue_t;
+
+static runqueue_t runqueues[MAX_CPU_COUNT];
+static _Atomic uint64_t idle_mask = 0;
+static int kick_vector = 0;
+
+// Per core, a thread never switches with it non-zero so it is always zero
+// across a switch and needs no saving
+static TLS int *preempt_count = NULL;
+
+// Dead threads keep their stacks for the next thread_create
+static thread_t *thread_cache = NULL;
+static int thread_cache_lock = 0;
+
+static runqueue_t *thread_rq(void) {
+  return &runqueues[interrupt_get_cpunum()];
+}
+
+static void rq_push(runqueue_t *rq, thread_t *t) {
+  t->next = NULL;
+  if (rq->tails[t->prio] != NULL)
+    rq->tails[t->prio]->next = t;
+  else
+    rq->heads[t->prio] = t;
+  rq->tails[t->prio] = t;
+  rq->bitmap |= (1u << t->prio);
+  rq->queued++;
+}
+
+// Highest priority first, O(1) through the bitmap
+static thread_t *rq_pop(runqueue_t *rq) {
+  if (rq->bitmap == 0)
+    return NULL;
+
+  int p = __builtin_ctz(rq->bitmap);
+  thread_t *t = rq->heads[p];
+  rq->heads[p] = t->next;
+  if (rq->heads[p] == NULL) {
+    rq->tails[p] = NULL;
+    rq->bitmap &= ~(1u << p);
+  }
+  rq->queued--;
+  t->next = NULL;
+  return t;
+}
+
+// First thread that may leave this core, scanning from the highest priority
+static thread_t *rq_steal(runqueue_t *rq) {
+  uint32_t bits = rq->bitmap;
+  while (bits != 0) {
+    int p = __builtin_ctz(bits);
+    bits &= bits - 1;
+
+    thread_t *prev = NULL;
+    for (thread_t *t = rq->heads[p]; t != NULL; prev = t, t = t->next) {
+      if (t->bound)
+        continue;
+
+      if (prev != NULL)
+        prev->next = t->next;
+      else
+        rq->heads[p] = t->next;
+      if (rq->tails[p] == t)
+        rq->tails[p] = prev;
+      if (rq->heads[p] == NULL)
+        rq->bitmap &= ~(1u << p);
+      rq->queued--;
+      t->next = NULL;
+      return t;
+    }
+  }
+  return NULL;
+}
+
+static void thread_slice(soft_timer_t *t, void *arg) {
+  t = NULL;
+  ((runqueue_t *)arg)->need_resched = true;
+}
+
+static void thread_yieldirq(int irq) {
+  irq = 0;
+  thread_rq()->need_resched = true;
+}
+
+// Only wakes the core, its idle loop does the rest
+static void thread_kickirq(int irq) { irq = 0; }
+
+// First FPU use since the switch. The registers are only reloaded if another
+// thread used them in between, or this one last used them on another core.
+static void thread_fpuirq(int irq) {
+  irq = 0;
+  runqueue_t *rq = thread_rq();
+  thread_t *cur = rq->cur;
+  int cpu = interrupt_get_cpunum();
+
+  fp_platform_settrap(false);
+  rq->fpu_trap = false;
+
+  if (cur->fpu_state == NULL) {
+    uintptr_t buf = (uintptr_t)malloc(fp_platform_getstatesize() +
+                                      fp_platform_getalign());
+    if (buf == 0)
+      PANIC("FPU state allocation failure!");
+    cur->fpu_state = (void *)ALIGN(buf, fp_platform_getalign());
+    fp_platform_getdefaultstate(cur->fpu_state);
+    cur->fpu_cpu = -1;
+  }
+
+  if (rq->fpu_last != cur || cur->fpu_cpu != cpu)
+    fp_platform_setstate(cur->fpu_state);
+
+  rq->fpu_last = cur;
+  cur->fpu_cpu = cpu;
+  cur->fpu_used = true;
+}
+
+// Runs on the way out of an interrupt with interrupts disabled. A ready thread
+// keeps the core against lower priorities, equal ones take turns.
+static void *thread_switch(void *frame) {
+  runqueue_t *rq = thread_rq();
+  if (rq->cur == NULL || !rq->need_resched)
+    return frame;
+
+  // Never switch with preemption disabled or at a raised priority level, the
+  // next thread would inherit the level and could spin on a lock the current
+  // one holds. need_resched stays set, preempt_enable or the retry takes it.
+  int level = interrupt_raisepriority(interrupt_priority_none);
+  if (*preempt_count != 0 || level != interrupt_priority_none) {
+    timer_arm(&rq->slice, THREAD_RETRY_NS, 0);
+    return frame;
+  }
+  rq->need_resched = false;
+
+  thread_t *prev = rq->cur;
+  thread_t *next = NULL;
+
+  // prev's state only changes under the lock, thread_wake may be looking at it
+  local_spinlock_lock(&rq->lock);
+  bool prev_ready =
+      prev != &rq->idle && prev->state == thread_state_running;
+  if (rq->bitmap != 0 &&
+      (!prev_ready || __builtin_ctz(rq->bitmap) <= prev->prio))
+    next = rq_pop(rq);
+  if (next == NULL && !prev_ready && prev != &rq->idle)
+    next = &rq->idle;
+
+  if (next != NULL) {
+    // prev stays off every queue until thread_switchdone, so no other core
+    // can resume it while this one is still on its stack
+    prev->frame = frame;
+    if (prev_ready)
+      prev->state = thread_state_ready;
+    rq->prev = prev;
+
+    next->state = thread_state_running;
+    next->cpu = interrupt_get_cpunum();
+    rq->cur = next;
+  }
+  local_spinlock_unlock(&rq->lock);
+
+  if (next == NULL)
+    return frame;
+  rq->switches++;
+
+  // Only general purpose registers move on a switch. FPU state is saved if
+  // prev used it this slice, and loaded on next's first use.
+  if (prev->fpu_used) {
+    if (prev->state != thread_state_dead)
+      fp_platform_getstate(prev->fpu_state);
+    prev->fpu_used = false;
+  }
+  if (!rq->fpu_trap) {
+    fp_platform_settrap(true);
+    rq->fpu_trap = true;
+  }
+
+  prev->level = level;
+  if (next->level != level)
+    interrupt_lowerpriority(next->level);
+
+  if (next != &rq->idle)
+    timer_arm(&rq->slice, THREAD_SLICE_NS, THREAD_SLICE_SLACK_NS);
+  else
+    timer_cancel(&rq->slice);
+
+  return next->frame;
+}
+
+static void thread_release(thread_t *t) {
+  local_spinlock_lock(&thread_cache_lock);
+  t->next = thread_cache;
+  thread_cache = t;
+  local_spinlock_unlock(&thread_cache_lock);
+}
+
+static void thread_switchdone(void) {
+  runqueue_t *rq = thread_rq();
+  thread_t *prev = rq->prev;
+  if (prev == NULL || prev == &rq->idle) {
+    rq->prev = NULL;
+    return;
+  }
+
+  if (prev->state == thread_state_dead) {
+    rq->prev = NULL;
+    thread_release(prev);
+    return;
+  }
+
+  // A blocked thread stays off the queue until thread_wake puts it back
+  local_spinlock_lock(&rq->lock);
+  rq->prev = NULL;
+  if (prev->state != thread_state_blocked)
+    rq_push(rq, prev);
+  local_spinlock_unlock(&rq->lock);
+}
+
+static void thread_start(void *arg) {
+  thread_t *t = (thread_t *)arg;
+  t->entry(t->arg);
+  thread_exit();
+}
+
+// Have cpu pick again if a thread of prio was just queued on it. Called with
+// interrupts disabled.
+static void thread_resched(int cpu, int prio) {
+  runqueue_t *rq = &runqueues[cpu];
+  thread_t *cur = __atomic_load_n(&rq->cur, __ATOMIC_ACQUIRE);
+  if (cur == NULL || (cur != &rq->idle && cur->prio <= prio))
+    return;
+
+  rq->need_resched = true;
+  if (cpu != interrupt_get_cpunum() && kick_vector != 0) {
+    interrupt_wakeidle(cpu);
+    interrupt_sendipi(interrupt_get_apicid(cpu), kick_vector,
+                      ipi_delivery_mode_fixed);
+  }
+}
+
+// Wake one idle core so it can steal, the caller's core is busy anyway
+static void thread_kick(void) {
+  uint64_t idle = __atomic_load_n(&idle_mask, __ATOMIC_ACQUIRE) &
+                  ~(1ull << interrupt_get_cpunum());
+  if (idle == 0 || kick_vector == 0)
+    return;
+
+  int cpu = __builtin_ctzll(idle);
+  interrupt_wakeidle(cpu);
+  interrupt_sendipi(interrupt_get_apicid(cpu), kick_vector,
+                    ipi_delivery_mode_fixed);
+}
+
+static thread_t *thread_new(const char *name, void (*entry)(void *),
+                            void *arg, int prio, bool bound) {
+  if (prio < 0 || prio >= THREAD_PRIO_COUNT)
+    return NULL;
+
+  int state = cli();
+  local_spinlock_lock(&thread_cache_lock);
+  thread_t *t = thread_cache;
+  if (t != NULL)
+    thread_cache = t->next;
+  local_spinlock_unlock(&thread_cache_lock);
+  sti(state);
+
+  if (t == NULL) {
+    t = malloc(sizeof(thread_t));
+    if (t == NULL)
+      return NULL;
+
+    uint8_t *stack = malloc(THREAD_STACK_SIZE);
+    if (stack == NULL) {
+      free(t);
+      return NULL;
+    }
+    t->kern_stack_top = stack + THREAD_STACK_SIZE;
+    t->fpu_state = NULL;
+  }
+
+  strncpy(t->name, name, sizeof(t->name) - 1);
+  t->name[sizeof(t->name) - 1] = 0;
+  t->entry = entry;
+  t->arg = arg;
+  t->prio = prio;
+  t->bound = bound;
+  t->state = thread_state_ready;
+  t->wakeup = false;
+  t->level = interrupt_priority_none;
+  t->fpu_cpu = -1;
+  t->fpu_used = false;
+  if (t->fpu_state != NULL)
+    fp_platform_getdefaultstate(t->fpu_state);
+
+  // Start as if thread_start was called, with a zero return address on top
+  uint64_t *top = (uint64_t *)t->kern_stack_top;
+  top[-1] = 0;
+  smp_platform_getdefaultstate(&t->registers, &top[-1], (void *)thread_start,
+                               t);
+  t->frame = interrupt_buildframe(&top[-2], &t->registers);
+
+  state = cli();
+  runqueue_t *rq = thread_rq();
+  t->cpu = interrupt_get_cpunum();
+  local_spinlock_lock(&rq->lock);
+  rq_push(rq, t);
+  local_spinlock_unlock(&rq->lock);
+  if (!bound)
+    thread_kick();
+  sti(state);
+
+  return t;
+}
+
+thread_t *thread_create(const char *name, void (*entry)(void *), void *arg,
+                        int prio) {
+  return thread_new(name, entry, arg, prio, false);
+}
+
+thread_t *thread_create_local(const char *name, void (*entry)(void *),
+                              void *arg, int prio) {
+  return thread_new(name, entry, arg, prio, true);
+}
+
+thread_t *thread_current(void) {
+  int state = cli();
+  thread_t *t = thread_rq()->cur;
+  sti(state);
+  return t;
+}
+
+void thread_yield(void) {
+  __asm__ volatile("int %0" ::"i"(THREAD_YIELD_VEC) : "memory");
+}
+
+void thread_exit(void) {
+  cli();
+  thread_t *t = thread_rq()->cur;
+  t->state = thread_state_dead;
+  sti(1);
+
+  thread_yield();
+  PANIC("Dead thread resumed!");
+}
+
+int thread_block(void) {
+  int state = cli();
+  runqueue_t *rq = thread_rq();
+  thread_t *t = rq->cur;
+  if (!state || t == NULL || t == &rq->idle || *preempt_count != 0 ||
+      interrupt_raisepriority(interrupt_priority_none) !=
+          interrupt_priority_none) {
+    sti(state);
+    return -1;
+  }
+
+  local_spinlock_lock(&rq->lock);
+  bool block = !t->wakeup;
+  t->wakeup = false;
+  if (block)
+    t->state = thread_state_blocked;
+  local_spinlock_unlock(&rq->lock);
+  sti(state);
+
+  // A wake before the switch sets it running again and this just yields
+  if (block)
+    thread_yield();
+  return 0;
+}
+
+void thread_wake(thread_t *t) {
+  if (t == NULL)
+    return;
+
+  // A blocked thread is on no queue and can't be stolen, so t->cpu is stable
+  int state = cli();
+  runqueue_t *rq = &runqueues[t->cpu];
+  bool queued = false;
+
+  local_spinlock_lock(&rq->lock);
+  if (t->state != thread_state_blocked) {
+    t->wakeup = true;
+  } else if (rq->cur == t) {
+    // Still on its way into thread_block's yield
+    t->state = thread_state_running;
+  } else {
+    // thread_switchdone queues it if it is still leaving its core
+    t->state = thread_state_ready;
+    if (rq->prev != t) {
+      rq_push(rq, t);
+      queued = true;
+    }
+  }
+  local_spinlock_unlock(&rq->lock);
+
+  if (queued)
+    thread_resched(t->cpu, t->prio);
+  sti(state);
+}
+
+void preempt_disable(void) {
+  if (preempt_count != NULL)
+    (*preempt_count)++;
+}
+
+void preempt_enable(void) {
+  if (preempt_count == NULL || --(*preempt_count) != 0)
+    return;
+
+  // Take the switch that was held off, if it can happen here
+  int state = cli();
+  bool resched = state && thread_rq()->need_resched &&
+                 interrupt_raisepriority(interrupt_priority_none) ==
+                     interrupt_priority_none;
+  sti(state);
+  if (resched)
+    thread_yield();
+}
+
+// Take the highest priority ready thread from the core with the most queued
+static bool thread_steal(runqueue_t *rq) {
+  int self = interrupt_get_cpunum();
+  uint64_t online = interrupt_getonlinemask();
+
+  int busiest = -1, most = 0;
+  for (int i = 0; i < MAX_CPU_COUNT; i++) {
+    if (i == self || !(online & (1ull << i)))
+      continue;
+    int q = __atomic_load_n(&runqueues[i].queued, __ATOMIC_RELAXED);
+    if (q > most) {
+      most = q;
+      busiest = i;
+    }
+  }
+  if (busiest < 0)
+    return false;
+
+  int state = cli();
+  runqueue_t *src = &runqueues[busiest];
+  local_spinlock_lock(&src->lock);
+  thread_t *t = rq_steal(src);
+  local_spinlock_unlock(&src->lock);
+
+  if (t != NULL) {
+    t->cpu = self;
+    local_spinlock_lock(&rq->lock);
+    rq_push(rq, t);
+    local_spinlock_unlock(&rq->lock);
+    rq->steals++;
+  }
+  sti(state);
+  return t != NULL;
+}
+
+void thread_idle(void) {
+  runqueue_t *rq = thread_rq();
+  uint64_t bit = 1ull << interrupt_get_cpunum();
+
+  while (true) {
+    // Advertised before looking so a thread_create racing the check kicks us
+    __atomic_fetch_or(&idle_mask, bit, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&rq->queued, __ATOMIC_RELAXED) != 0 ||
+        thread_steal(rq)) {
+      __atomic_fetch_and(&idle_mask, ~bit, __ATOMIC_SEQ_CST);
+      thread_yield();
+      continue;
+    }
+    interrupt_idle();
+  }
+}
+
+void thread_mp_init(void) {
+  runqueue_t *rq = thread_rq();
+  strncpy(rq->idle.name, "idle", sizeof(rq->idle.name));
+  rq->idle.prio = THREAD_PRIO_COUNT - 1;
+  rq->idle.cpu = interrupt_get_cpunum();
+  rq->idle.state = thread_state_running;
+  rq->idle.level = interrupt_priority_none;
+  rq->idle.fpu_cpu = -1;
+  timer_setup(&rq->slice, thread_slice, rq);
+  __atomic_store_n(&rq->cur, &rq->idle, __ATOMIC_RELEASE);
+}
+
+void thread_init(void) {
+  preempt_count = (TLS int *)tls_alloc(sizeof(int));
+
+  int vec = THREAD_YIELD_VEC;
+  if (interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_fixed,
+                         &vec) != 0)
+    PANIC("Yield vector unavailable!");
+  interrupt_registerhandler(vec, thread_yieldirq);
+
+  if (interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_ipi,
+                         &kick_vector) != 0)
+    PANIC("Kick vector unavailable!");
+  interrupt_registerhandler(kick_vector, thread_kickirq);
+
+  vec = THREAD_NM_VEC;
+  if (interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_fixed,
+                         &vec) != 0)
+    PANIC("#NM vector unavailable!");
+  interrupt_registerhandler(vec, thread_fpuirq);
+
+  thread_mp_init();
+  interrupt_setswitch(thread_switch, thread_switchdone);
+}
+
+#ifdef BENCHMARK
+#define THREAD_BENCH_COUNT (4096)
+#define THREAD_BENCH_INFLIGHT (256)
+#define THREAD_BENCH_WORK (20000) // cycles each thread spins for
+
+static _Atomic uint64_t thread_bench_done = 0;
+static uint64_t thread_bench_ran[MAX_CPU_COUNT];
+
+static void thread_bench_func(void *arg) {
+  arg = NULL;
+  uint64_t start = rdtsc();
+  while (rdtsc() - start < THREAD_BENCH_WORK)
+    __asm__ volatile("pause");
+
+  int state = cli();
+  thread_bench_ran[interrupt_get_cpunum()]++;
+  sti(state);
+  thread_bench_done++;
+}
+
+// Many short threads created on one core, the rest only get them by stealing.
+// Reports cycles per thread overall next to the work each one does.
+void thread_benchmark(void) {
+  memset(thread_bench_ran, 0, sizeof(thread_bench_ran));
+  uint64_t steals[MAX_CPU_COUNT];
+  for (int i = 0; i < MAX_CPU_COUNT; i++)
+    steals[i] = runqueues[i].steals;
+
+  thread_bench_done = 0;
+  uint64_t start = rdtsc();
+  for (uint64_t i = 0; i < THREAD_BENCH_COUNT; i++) {
+    while (i - thread_bench_done >= THREAD_BENCH_INFLIGHT)
+      thread_yield();
+    if (thread_create("bench", thread_bench_func, NULL,
+                      THREAD_PRIO_DEFAULT) == NULL)
+      PANIC("Benchmark thread creation failed!");
+  }
+  while (thread_bench_done < THREAD_BENCH_COUNT)
+    thread_yield();
+  uint64_t cycles = rdtsc() - start;
+
+  print_str("Threads: ");
+  print_uint64(THREAD_BENCH_COUNT, BASE_HEX);
+  print_str(" cores: ");
+  print_int32(smp_corecount(), BASE_HEX);
+  print_str(" cycles per thread: ");
+  print_uint64(cycles / THREAD_BENCH_COUNT, BASE_HEX);
+  print_str(" work: ");
+  print_uint64(THREAD_BENCH_WORK, BASE_HEX);
+  print_str("\r\n");
+
+  for (int i = 0; i < MAX_CPU_COUNT; i++) {
+    if (thread_bench_ran[i] == 0)
+      continue;
+    print_str("[Core: ");
+    print_int32(i, BASE_HEX);
+    print_str("] Ran: ");
+    print_uint64(thread_bench_ran[i], BASE_HEX);
+    print_str(" Steals: ");
+    print_uint64(runqueues[i].steals - steals[i], BASE_HEX);
+    print_str("\r\n");
+  }
+}
+
+#define SWITCH_BENCH_ITERS (100000)
+
+static _Atomic int switch_bench_done = 0;
+
+static void switch_bench_func(void *arg) {
+  bool fpu = arg != NULL;
+  for (int i = 0; i < SWITCH_BENCH_ITERS; i++) {
+    if (fpu)
+      __asm__ volatile("fldz\n\tfstp %%st(0)" ::: "memory");
+    thread_yield();
+  }
+  switch_bench_done++;
+}
+
+// Two threads bound to this core yielding to each other, cycles per switch
+// without and with each of them touching the FPU every time it runs.
+void thread_switch_benchmark(void) {
+  for (int fpu = 0; fpu < 2; fpu++) {
+    switch_bench_done = 0;
+    uint64_t switches = thread_rq()->switches;
+
+    uint64_t start = rdtsc();
+    thread_create_local("ping", switch_bench_func, fpu ? (void *)1 : NULL,
+                        THREAD_PRIO_DEFAULT);
+    thread_create_local("pong", switch_bench_func, fpu ? (void *)1 : NULL,
+                        THREAD_PRIO_DEFAULT);
+    while (switch_bench_done < 2)
+      thread_yield();
+    uint64_t cycles = rdtsc() - start;
+    switches = thread_rq()->switches - switches;
+
+    print_str(fpu ? "FPU" : "GPR");
+    print_str(" context switch cycles: ");
+    print_uint64(cycles / switches, BASE_HEX);
+    print_str(" switches: ");
+    print_uint64(switches, BASE_HEX);
+    print_str("\r\n");
+  }
+}
+#endif
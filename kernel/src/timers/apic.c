@@ -6,6 +6,7 @@
  */
 
 #include "cpuid.h"
+#include "debug.h"
 #include "interrupts.h"
 #include "memory.h"
 #include "priv_timers.h"
@@ -16,19 +17,123 @@
 
 #define IA32_TSC_DEADLINE 0x6e0
 
+#define APIC_TIMER_ONESHOT (0)
+#define APIC_TIMER_PERIODIC (1)
+#define APIC_TIMER_TSC_DEADLINE (2)
+#define APIC_TIMER_HPET (3) // apic timer idle, per-core HPET comparator instead
+
+#define APIC_CALIBRATE_MS (10)
+#define APIC_CALIBRATE_RUNS (3)
+
 typedef struct {
-  bool tsc_mode;
+  int mode;
+  bool tickless;
   bool enabled;
   bool oneshot;
+  uint64_t ticks;      // interrupts seen in periodic mode
+  uint64_t base;       // apic counts elapsed before the current one-shot
+  uint32_t programmed; // initial count of the current one-shot
+  uint64_t offset;     // keeps the tick clock continuous across mode changes
+  uint64_t next;       // tick the timer is programmed for
+  uint64_t last_legacy;
+  int hpet_chan; // claimed HPET comparator, -1 if none
+  uint64_t irqs;
+  uint64_t freq; // calibrated apic timer rate of this core
   void (*handler)(int);
 } tls_apic_timer_state_t;
 
-int local_apic_timer_init(bool tsc_mode, void (*handler)(int), bool ap);
+int local_apic_timer_init(int mode, void (*handler)(int), bool ap);
+void apic_timer_setcount(uint32_t count);
+uint32_t apic_timer_getcount(void);
 PRIVATE uint64_t tsc_read(timer_handlers_t *handlers);
 static TLS tls_apic_timer_state_t *apic_state = NULL;
+static int apic_vector = 0;
+static bool apic_tickless = true;
+static uint64_t apic_bsp_freq = 0;
+
+static uint64_t tsc_per_tick(void) {
+  return get_cpuid()->tsc_freq / APIC_TIMER_RATE;
+}
+
+static uint64_t apic_per_tick(void) {
+  return apic_state->freq / APIC_TIMER_RATE;
+}
+
+static uint64_t hpet_per_tick(void) { return hpet_getrate() / APIC_TIMER_RATE; }
+
+static uint64_t apic_timer_raw(void) {
+  switch (apic_state->mode) {
+  case APIC_TIMER_TSC_DEADLINE:
+    return rdtsc() / tsc_per_tick();
+  case APIC_TIMER_HPET:
+    return hpet_readcounter() / hpet_per_tick();
+  case APIC_TIMER_ONESHOT:
+    return (apic_state->base + apic_state->programmed - apic_timer_getcount()) /
+           apic_per_tick();
+  default:
+    return apic_state->ticks;
+  }
+}
+
+// Current tick on the calling core, in APIC_TIMER_RATE units
+PRIVATE uint64_t apic_timer_now(void) {
+  return apic_timer_raw() + apic_state->offset;
+}
+
+// Fire the next interrupt at tick, TIMER_TICK_NEVER parks the timer. A parked
+// one-shot still runs its longest countdown so the tick clock keeps moving.
+static void apic_timer_program(uint64_t tick) {
+  apic_state->next = tick;
+
+  if (apic_state->mode == APIC_TIMER_TSC_DEADLINE) {
+    if (tick == TIMER_TICK_NEVER)
+      wrmsr(IA32_TSC_DEADLINE, 0);
+    else
+      wrmsr(IA32_TSC_DEADLINE, (tick - apic_state->offset) * tsc_per_tick());
+  } else if (apic_state->mode == APIC_TIMER_HPET) {
+    if (tick == TIMER_TICK_NEVER)
+      hpet_clockevent_program(apic_state->hpet_chan, ~0ull);
+    else
+      hpet_clockevent_program(apic_state->hpet_chan,
+                              (tick - apic_state->offset) * hpet_per_tick());
+  } else if (apic_state->mode == APIC_TIMER_ONESHOT) {
+    // Counts between expiry and reprogramming are lost, so the clock can lag
+    // by the interrupt latency of each one-shot
+    apic_state->base += apic_state->programmed - apic_timer_getcount();
+
+    uint64_t cnt = 0xFFFFFFFF;
+    if (tick != TIMER_TICK_NEVER) {
+      uint64_t target = 0;
+      if (tick > apic_state->offset)
+        target = (tick - apic_state->offset) * apic_per_tick();
+
+      if (target <= apic_state->base)
+        cnt = 1;
+      else if (target - apic_state->base < cnt)
+        cnt = target - apic_state->base;
+    }
+
+    apic_state->programmed = cnt;
+    apic_timer_setcount(cnt);
+  }
+}
+
+// Bring the interrupt forward if a timer was armed before the programmed one
+PRIVATE void apic_timer_rearm(uint64_t tick) {
+  if (apic_state->tickless && tick < apic_state->next)
+    apic_timer_program(tick);
+}
 
 PRIVATE void apic_handler(int irq) {
-  if (apic_state->enabled) {
+  apic_state->irqs++;
+  if (!apic_state->tickless)
+    apic_state->ticks++;
+
+  uint64_t now = apic_timer_now();
+  timer_wheel_advance(now + 1);
+
+  if (apic_state->enabled && now != apic_state->last_legacy) {
+    apic_state->last_legacy = now;
     if (apic_state->handler != NULL)
       apic_state->handler(irq);
 
@@ -36,6 +141,56 @@ PRIVATE void apic_handler(int irq) {
       apic_state->enabled = false;
     }
   }
+
+  if (apic_state->tickless) {
+    uint64_t next = timer_wheel_next();
+    // Owners of the whole timer still expect a tick every period
+    if (apic_state->enabled && next > now + 1)
+      next = now + 1;
+    apic_timer_program(next);
+  }
+}
+
+static void apic_timer_configure(bool tickless) {
+  int state = cli();
+  uint64_t now = apic_timer_now();
+
+  if (apic_state->mode == APIC_TIMER_HPET)
+    hpet_clockevent_program(apic_state->hpet_chan, ~0ull);
+
+  // HPET deadlines are absolute, so they are preferred over one-shot counts
+  int mode = APIC_TIMER_PERIODIC;
+  if (tickless) {
+    if (get_cpuid()->tsc_deadline && use_tsc())
+      mode = APIC_TIMER_TSC_DEADLINE;
+    else if (apic_state->hpet_chan >= 0 ||
+             (apic_state->hpet_chan = hpet_clockevent_claim(apic_handler)) >= 0)
+      mode = APIC_TIMER_HPET;
+    else
+      mode = APIC_TIMER_ONESHOT;
+  }
+
+  apic_state->mode = mode;
+  apic_state->tickless = tickless;
+  apic_state->base = 0;
+  apic_state->programmed = 0;
+  apic_vector = local_apic_timer_init(
+      mode == APIC_TIMER_HPET ? APIC_TIMER_ONESHOT : mode, apic_handler,
+      apic_vector != 0);
+  if (mode == APIC_TIMER_PERIODIC)
+    apic_timer_setcount(apic_per_tick());
+
+  apic_state->offset = 0;
+  apic_state->offset = now - apic_timer_raw();
+
+  if (tickless)
+    apic_timer_program(apic_state->enabled ? now + 1 : timer_wheel_next());
+  sti(state);
+}
+
+void timer_settickless(bool tickless) {
+  if (tickless != apic_state->tickless)
+    apic_timer_configure(tickless);
 }
 
 PRIVATE uint64_t apic_timer_setmode(timer_handlers_t *handler,
@@ -53,7 +208,11 @@ PRIVATE uint64_t apic_timer_setmode(timer_handlers_t *handler,
 
 PRIVATE void apic_timer_setenable(timer_handlers_t *handler, bool enable) {
   handler = NULL;
+  int state = cli();
   apic_state->enabled = enable;
+  if (enable)
+    apic_timer_rearm(apic_timer_now() + 1);
+  sti(state);
 }
 
 PRIVATE void apic_timer_sethandler(timer_handlers_t *state,
@@ -62,7 +221,85 @@ PRIVATE void apic_timer_sethandler(timer_handlers_t *state,
   apic_state->handler = handler;
 }
 
-static bool apic_init_done = false;
+// Apic timer counts since the countdown was started from its maximum
+static uint64_t apic_timer_elapsed(void) {
+  return 0xFFFFFFFF - apic_timer_getcount();
+}
+
+static uint64_t apic_calibrate_tsc(void) { return rdtsc(); }
+
+// Apic timer ticks per second against a reference counter of known rate
+static uint64_t apic_timer_measure(uint64_t (*ref)(void), uint64_t rate,
+                                   uint32_t ms) {
+  uint64_t ticks = rate * ms / 1000;
+
+  uint64_t r0 = ref();
+  uint64_t a0 = apic_timer_elapsed();
+  uint64_t r1 = r0;
+  while (r1 - r0 < ticks)
+    r1 = ref();
+  uint64_t a1 = apic_timer_elapsed();
+
+  return (a1 - a0) * rate / (r1 - r0);
+}
+
+// Measure this core's apic timer against the calibrated TSC, the HPET, or on
+// the BSP the PIT. The PIT is a single shared device, so APs without either of
+// the others take the BSP's rate. The spread of the runs is reported as the
+// error.
+static void apic_timer_calibrate(bool ap) {
+  apic_vector = local_apic_timer_init(APIC_TIMER_ONESHOT, apic_handler, ap);
+
+  uint64_t total = 0, min = 0, max = 0;
+  for (int i = 0; i < APIC_CALIBRATE_RUNS; i++) {
+    int state = cli();
+    apic_timer_setcount(0xFFFFFFFF);
+
+    uint64_t freq = 0;
+    if (get_cpuid()->tsc_valid && get_cpuid()->tsc_freq != 0)
+      freq = apic_timer_measure(apic_calibrate_tsc, get_cpuid()->tsc_freq,
+                                APIC_CALIBRATE_MS);
+    else if (hpet_getrate() != 0)
+      freq = apic_timer_measure(hpet_readcounter, hpet_getrate(),
+                                APIC_CALIBRATE_MS);
+    else if (!ap)
+      freq = pit_calibrate(APIC_CALIBRATE_MS, apic_timer_elapsed);
+
+    apic_timer_setcount(0);
+    sti(state);
+
+    if (freq == 0)
+      break;
+    total += freq;
+    if (min == 0 || freq < min)
+      min = freq;
+    if (freq > max)
+      max = freq;
+  }
+
+  uint64_t freq = min == 0 ? 0 : total / APIC_CALIBRATE_RUNS;
+  if (freq == 0)
+    freq = ap ? apic_bsp_freq : get_cpuid()->apic_freq;
+  if (freq == 0)
+    PANIC("APIC timer calibration failed!");
+
+  apic_state->freq = freq;
+  if (!ap)
+    apic_bsp_freq = freq;
+
+  print_str("[Core: ");
+  print_int32(interrupt_get_cpunum(), BASE_HEX);
+  print_str("] APIC timer: ");
+  print_uint64(freq, BASE_HEX);
+  print_str(" +/- ");
+  print_uint64(max - min, BASE_HEX);
+  if (get_cpuid()->apic_freq != 0) {
+    print_str(" CPUID: ");
+    print_uint64(get_cpuid()->apic_freq, BASE_HEX);
+  }
+  print_str("\r\n");
+}
+
 PRIVATE int apic_timer_init() {
 
   if (apic_state == NULL) {
@@ -75,7 +312,7 @@ PRIVATE int apic_timer_init() {
           timer_features_persistent | timer_features_oneshot |
           timer_features_periodic | timer_features_local;
 
-      main_counter.rate = 20000; // 0.05ms
+      main_counter.rate = APIC_TIMER_RATE;
       main_counter.read = NULL;
       main_counter.write = NULL;
       main_counter.set_mode = apic_timer_setmode;       // TODO
@@ -86,37 +323,82 @@ PRIVATE int apic_timer_init() {
     }
   }
 
-  apic_state->tsc_mode = false;
+  apic_state->mode = APIC_TIMER_PERIODIC;
+  apic_state->tickless = false;
   apic_state->enabled = false;
   apic_state->oneshot = false;
+  apic_state->ticks = 0;
+  apic_state->offset = 0;
+  apic_state->next = TIMER_TICK_NEVER;
+  apic_state->last_legacy = TIMER_TICK_NEVER;
+  apic_state->hpet_chan = -1;
+  apic_state->irqs = 0;
   apic_state->handler = NULL;
+  timer_wheel_init(0);
 
-  local_apic_timer_init(false, apic_handler, apic_init_done);
+  apic_timer_calibrate(apic_vector != 0);
 
-  apic_init_done = true;
+  apic_timer_configure(apic_tickless);
   return 0;
 }
 
-PRIVATE int apic_timer_tsc_init() {
-  local_apic_timer_init(true, apic_handler, apic_init_done);
+#ifdef BENCHMARK
+#define TICKLESS_BENCH_IDLE_NS (100 * 1000 * 1000)
+#define TICKLESS_BENCH_WAKEUPS (100)
+#define TICKLESS_BENCH_SLEEP_NS (1000 * 1000)
+
+static volatile bool tickless_bench_fired = false;
+static volatile uint64_t tickless_bench_stamp = 0;
+
+static void tickless_bench_func(soft_timer_t *t, void *arg) {
+  t = NULL;
+  arg = NULL;
+  tickless_bench_stamp = rdtsc();
+  tickless_bench_fired = true;
+}
+
+static void tickless_bench_sleep(soft_timer_t *t, uint64_t ns) {
+  tickless_bench_fired = false;
+  timer_arm(t, ns, 0);
+  while (!tickless_bench_fired)
+    interrupt_idle();
+}
+
+// Timer interrupts taken while idle for 100ms, and the cycles from arming a
+// 1ms timer to its handler running, for both periodic and tickless modes.
+void timer_tickless_benchmark(void) {
+  soft_timer_t t;
+  timer_setup(&t, tickless_bench_func, NULL);
+  bool orig = apic_state->tickless;
+
+  for (int m = 0; m < 2; m++) {
+    timer_settickless(m != 0);
 
-  {
-    timer_handlers_t main_counter;
-    timer_features_t main_features =
-        timer_features_read | timer_features_64bit | timer_features_persistent |
-        timer_features_oneshot | timer_features_periodic |
-        timer_features_fixed_intr | timer_features_local;
+    // Counted in the handler since HPET clock events use their own vector
+    uint64_t cnt = apic_state->irqs;
+    tickless_bench_sleep(&t, TICKLESS_BENCH_IDLE_NS);
+    uint64_t irqs = apic_state->irqs - cnt;
 
-    main_features |= timer_features_counter | timer_features_write;
-    main_counter.rate = get_cpuid()->tsc_freq;
-    strncpy(main_counter.name, "apic_tsc", 16);
-    main_counter.read = NULL;
-    main_counter.write = NULL;
-    main_counter.set_mode = NULL;
-    main_counter.set_enable = NULL;
-    main_counter.set_handler = NULL;
+    uint64_t total = 0, max = 0;
+    for (int i = 0; i < TICKLESS_BENCH_WAKEUPS; i++) {
+      uint64_t start = rdtsc();
+      tickless_bench_sleep(&t, TICKLESS_BENCH_SLEEP_NS);
+      uint64_t lat = tickless_bench_stamp - start;
+      total += lat;
+      if (lat > max)
+        max = lat;
+    }
 
-    timer_register(main_features, &main_counter);
+    print_str(m ? "Tickless" : "Periodic");
+    print_str(" timer irqs per 100ms idle: ");
+    print_uint64(irqs, BASE_HEX);
+    print_str(" 1ms wakeup avg cycles: ");
+    print_uint64(total / TICKLESS_BENCH_WAKEUPS, BASE_HEX);
+    print_str(" max: ");
+    print_uint64(max, BASE_HEX);
+    print_str("\r\n");
   }
-  return 0;
-}
\ No newline at end of file
+
+  timer_settickless(orig);
+}
+#endif
@@ -0,0 +1,197 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
+#include "types.h"
+
+#include "debug.h"
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "priv_timers.h"
+#include "timer.h"
+
+#define CLOCK_SHIFT (32)
+#define CLOCK_COST_READS (64)
+#define CLOCK_STATES (4)
+
+// ns = base_ns + ((count - base_cnt) * mult) >> CLOCK_SHIFT
+typedef struct {
+  timer_handlers_t *src;
+  bool is_tsc; // read with a bare rdtsc instead of through src
+  uint64_t mult;
+  uint64_t base_cnt;
+  uint64_t base_ns;
+} clock_state_t;
+
+// States are never modified once published, a reselect fills the next slot
+// and swaps cur_clock over to it. Readers that loaded the old pointer keep a
+// consistent view, a slot is only reused CLOCK_STATES selects later.
+static clock_state_t clock_states[CLOCK_STATES];
+static clock_state_t *_Atomic cur_clock = NULL;
+static int clock_states_next = 0;
+static int select_lock = 0;
+// realtime = monotonic + realtime_offset
+static uint64_t realtime_offset = 0;
+
+extern bool tsc_sw_offsets;
+
+static uint64_t clock_readcost(timer_handlers_t *h, int reads) {
+  uint64_t start = rdtsc();
+  for (int i = 0; i < reads; i++)
+    h->read(h);
+  return (rdtsc() - start) / reads;
+}
+
+// Software tsc offsets are per core, which user code can't apply
+PRIVATE void clocksource_publish() {
+  clock_state_t *c = __atomic_load_n(&cur_clock, __ATOMIC_ACQUIRE);
+  timepage_setclock(c->is_tsc && !tsc_sw_offsets ? time_page_mode_tsc
+                                                 : time_page_mode_none,
+                    c->mult, CLOCK_SHIFT, c->base_cnt, c->base_ns);
+}
+
+// Stable counters beat unstable ones, then the cheapest to read wins, with
+// the higher rate breaking ties.
+PRIVATE void clocksource_select() {
+  timer_handlers_t *best = NULL;
+  bool best_stable = false;
+  uint64_t best_cost = 0;
+
+  timer_features_t features;
+  timer_handlers_t *h;
+  for (int i = 0; timer_getcounter(i, &features, &h) == 0; i++) {
+    // Absolute counters follow the wall clock, which can step, and 32-bit
+    // ones (a 32-bit HPET wraps every ~300s) would make the clock go back
+    if (!(features & timer_features_counter) ||
+        !(features & timer_features_64bit) ||
+        (features & timer_features_absolute) || h->read == NULL ||
+        h->rate == 0)
+      continue;
+
+    bool stable = (features & timer_features_stable) != 0;
+    uint64_t cost = clock_readcost(h, CLOCK_COST_READS);
+
+    if (best != NULL) {
+      if (best_stable && !stable)
+        continue;
+      if (best_stable == stable &&
+          (cost > best_cost || (cost == best_cost && h->rate <= best->rate)))
+        continue;
+    }
+
+    best = h;
+    best_stable = stable;
+    best_cost = cost;
+  }
+
+  if (best == NULL)
+    PANIC("No usable clocksource!");
+
+  int state = cli();
+  local_spinlock_lock(&select_lock);
+
+  clock_state_t *c = &clock_states[clock_states_next];
+  clock_states_next = (clock_states_next + 1) % CLOCK_STATES;
+
+  // Carry the current time over so a later switch doesn't step the clock
+  uint64_t now = cur_clock != NULL ? clock_monotonic_ns() : 0;
+
+  c->src = best;
+  c->is_tsc = strncmp(best->name, "tsc", 16) == 0;
+  c->mult = (1000000000ull << CLOCK_SHIFT) / best->rate;
+  c->base_cnt = best->read(best);
+  c->base_ns = now;
+  __atomic_store_n(&cur_clock, c, __ATOMIC_RELEASE);
+  clocksource_publish();
+
+  local_spinlock_unlock(&select_lock);
+  sti(state);
+
+  print_str("Clocksource: ");
+  print_str(best->name);
+  print_str("\r\n");
+}
+
+// Drop the stable flag from the named counter and pick again
+PRIVATE void clocksource_unstable(const char *name) {
+  timer_features_t features;
+  timer_handlers_t *h;
+  for (int i = 0; timer_getcounter(i, &features, &h) == 0; i++)
+    if (strncmp(h->name, name, 16) == 0)
+      timer_clearfeatures(i, timer_features_stable);
+
+  clocksource_select();
+}
+
+uint64_t clock_monotonic_ns(void) {
+  clock_state_t *c = __atomic_load_n(&cur_clock, __ATOMIC_ACQUIRE);
+  uint64_t cnt = c->is_tsc ? tsc_local() : c->src->read(c->src);
+  unsigned __int128 delta = (unsigned __int128)(cnt - c->base_cnt) * c->mult;
+  return c->base_ns + (uint64_t)(delta >> CLOCK_SHIFT);
+}
+
+uint64_t clock_realtime_ns(void) {
+  return clock_monotonic_ns() +
+         __atomic_load_n(&realtime_offset, __ATOMIC_RELAXED);
+}
+
+PRIVATE uint64_t clock_getrealtime(void) {
+  return __atomic_load_n(&realtime_offset, __ATOMIC_RELAXED);
+}
+
+PRIVATE void clock_setrealtime(uint64_t offset) {
+  __atomic_store_n(&realtime_offset, offset, __ATOMIC_RELAXED);
+  timepage_setrealtime(offset);
+}
+
+const char *clock_getsource(void) {
+  return __atomic_load_n(&cur_clock, __ATOMIC_ACQUIRE)->src->name;
+}
+
+#ifdef BENCHMARK
+#define CLOCK_BENCH_READS (10000)
+
+// Cycles per read of every registered counter, and of clock_monotonic_ns
+void clock_benchmark(void) {
+  timer_features_t features;
+  timer_handlers_t *h;
+  for (int i = 0; timer_getcounter(i, &features, &h) == 0; i++) {
+    if (!(features & timer_features_counter) || h->read == NULL)
+      continue;
+
+    print_str("Counter ");
+    print_str(h->name);
+    print_str(" rate: ");
+    print_uint64(h->rate, BASE_HEX);
+    print_str(" read cycles: ");
+    print_uint64(clock_readcost(h, CLOCK_BENCH_READS), BASE_HEX);
+    print_str("\r\n");
+  }
+
+  uint64_t start = rdtsc();
+  for (int i = 0; i < CLOCK_BENCH_READS; i++)
+    clock_monotonic_ns();
+  uint64_t cost = (rdtsc() - start) / CLOCK_BENCH_READS;
+
+  print_str("clock_monotonic_ns (");
+  print_str(clock_getsource());
+  print_str(") read cycles: ");
+  print_uint64(cost, BASE_HEX);
+  print_str("\r\n");
+
+  start = rdtsc();
+  for (int i = 0; i < CLOCK_BENCH_READS; i++)
+    clock_realtime_ns();
+  cost = (rdtsc() - start) / CLOCK_BENCH_READS;
+
+  print_str("clock_realtime_ns read cycles: ");
+  print_uint64(cost, BASE_HEX);
+  print_str("\r\n");
+}
+#endif
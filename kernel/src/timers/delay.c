@@ -0,0 +1,64 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "types.h"
+
+#include "interrupts.h"
+#include "priv_timers.h"
+#include "thread.h"
+#include "timer.h"
+
+// Below two wheel ticks the wakeup granularity costs more than spinning
+#define SLEEP_MIN_NS (2 * 1000000000ull / APIC_TIMER_RATE)
+
+void ndelay(uint64_t ns) {
+  uint64_t end = clock_monotonic_ns() + ns;
+  while (clock_monotonic_ns() < end)
+    __asm__ volatile("pause");
+}
+
+void udelay(uint64_t us) { ndelay(us * 1000); }
+
+typedef struct {
+  volatile bool done;
+  thread_t *thread;
+} sleeper_t;
+
+static void sleep_wake(soft_timer_t *t, void *arg) {
+  t = NULL;
+  sleeper_t *s = (sleeper_t *)arg;
+
+  // Once done is seen the sleeper may return and reuse its stack
+  thread_t *thread = s->thread;
+  s->done = true;
+  thread_wake(thread);
+}
+
+void timer_sleep(uint64_t ns) {
+  int state = cli();
+  sti(state);
+  if (!state || ns < SLEEP_MIN_NS) {
+    ndelay(ns);
+    return;
+  }
+
+  // Both the timer and the sleeper live on this stack, the wheel is per core
+  // so any number of cores can sleep at once
+  sleeper_t s = {.done = false, .thread = thread_current()};
+  soft_timer_t t;
+  timer_setup(&t, sleep_wake, &s);
+  timer_arm(&t, ns, 0);
+
+  // Threads give up the core, the idle loop and early boot halt it instead
+  while (!s.done)
+    if (thread_block() != 0)
+      interrupt_idle();
+}
+
+void msleep(uint64_t ms) { timer_sleep(ms * 1000 * 1000); }
@@ -9,6 +9,7 @@
 #include <string.h>
 
 #include "interrupts.h"
+#include "local_spinlock.h"
 
 #include "priv_timers.h"
 #include "timer.h"
@@ -78,10 +79,15 @@ typedef struct {
 typedef struct {
   HPET_Main *hpet;
   bool enabled;
+  bool percpu; // reserved as a per-core clock event
+  int cpu;     // core that claimed it, -1 if unclaimed
+  int vector;
   void (*cur_handler)(int);
 } HPET_TimerState;
 
 static HPET_TimerState *timers;
+static HPET_Main *hpet_main = NULL;
+static int hpet_claim_lock = 0;
 
 PRIVATE uint64_t hpet_main_read(timer_handlers_t *handler) {
   HPET_Main *hpet = (HPET_Main *)handler->state;
@@ -147,7 +153,7 @@ PRIVATE void hpet_timer_sendeoi(timer_handlers_t *handler) {
 PRIVATE void hpet_timer_handler(int irq) {
   HPET_Main *hpet = timers[0].hpet;
   for (int i = 0; i <= hpet->Capabilities.TimerCount; i++) {
-    if (timers[i].enabled) {
+    if (timers[i].enabled && !timers[i].percpu) {
       if (timers[i].cur_handler != NULL)
         timers[i].cur_handler(irq);
       hpet->InterruptStatus = (1u << i);
@@ -155,10 +161,22 @@ PRIVATE void hpet_timer_handler(int irq) {
   }
 }
 
+// Point every FSB delivered timer at the new destination
+PRIVATE void hpet_retarget(int irq, int apic_id) {
+  irq = 0;
+  HPET_Main *hpet = timers[0].hpet;
+  for (int i = 0; i <= hpet->Capabilities.TimerCount; i++)
+    if (hpet->timers[i].Configuration.FSBInterruptEnable && !timers[i].percpu)
+      hpet->timers[i].InterruptRoute.Address = msi_register_addr(apic_id);
+}
+
 PRIVATE int hpet_getcount() {
+  HPET *hpet_table = acpi_tables_find_table(HPET_SIG);
+  if (hpet_table == NULL)
+    return 0;
+
   HPET_Main *base_addr = NULL;
-  intptr_t hpet_phys_base_addr =
-      ((HPET *)acpi_tables_find_table(HPET_SIG))->Address.address;
+  intptr_t hpet_phys_base_addr = hpet_table->Address.address;
 
   base_addr =
       (HPET_Main *)vmem_phystovirt(hpet_phys_base_addr, sizeof(HPET_Main),
@@ -168,10 +186,12 @@ PRIVATE int hpet_getcount() {
 }
 
 PRIVATE int hpet_init() {
+  HPET *hpet_table = acpi_tables_find_table(HPET_SIG);
+  if (hpet_table == NULL)
+    return -1;
 
   HPET_Main *base_addr = NULL;
-  intptr_t hpet_phys_base_addr =
-      ((HPET *)acpi_tables_find_table(HPET_SIG))->Address.address;
+  intptr_t hpet_phys_base_addr = hpet_table->Address.address;
 
   base_addr =
       (HPET_Main *)vmem_phystovirt(hpet_phys_base_addr, sizeof(HPET_Main),
@@ -192,7 +212,8 @@ PRIVATE int hpet_init() {
     timer_handlers_t main_counter = {.name = "hpet_main"};
     timer_features_t main_features = common_features;
 
-    main_features |= timer_features_counter | timer_features_write;
+    main_features |= timer_features_counter | timer_features_write |
+                     timer_features_stable;
 
     main_counter.rate =
         1000000000000000 / (uint64_t)base_addr->Capabilities.ClockPeriod;
@@ -206,14 +227,38 @@ PRIVATE int hpet_init() {
     timer_register(main_features, &main_counter);
   }
 
+  // Enable the counter, the comparators stay disabled until requested
+  base_addr->Configuration.GlobalEnable = 1;
+  hpet_main = base_addr;
+
+  return 0;
+}
+
+// Register the comparators. With percpu the FSB capable ones are kept back
+// to serve as per-core one-shot clock events.
+PRIVATE int hpet_comparators_init(bool percpu) {
+  HPET_Main *base_addr = hpet_main;
+  if (base_addr == NULL)
+    return -1;
+
+  timer_features_t common_features =
+      timer_features_persistent | timer_features_read;
+  if (base_addr->Capabilities.Is64Bit)
+    common_features |= timer_features_64bit;
+
+  // The tick clock is derived from the main counter, which must not wrap
+  if (!base_addr->Capabilities.Is64Bit)
+    percpu = false;
+
   // Allocate interrupt handler
-  int intrpt_num = 240; // low priority interrupt
-  interrupt_allocate(1, interrupt_flags_none, &intrpt_num);
-  timers = (HPET_TimerState *)malloc(
-      sizeof(HPET_TimerState) * base_addr->Capabilities.TimerCount + 1);
+  int intrpt_num = 0xE1;
+  interrupt_allocate(1, interrupt_flags_timer, &intrpt_num);
+  timers = (HPET_TimerState *)malloc(sizeof(HPET_TimerState) *
+                                     (base_addr->Capabilities.TimerCount + 1));
   interrupt_registerhandler(intrpt_num, hpet_timer_handler);
 
   // Enable MSI/FSB interrupt mode for timers, but keep interrupts disabled
+  bool fsb_only = true;
   for (int i = 0; i <= base_addr->Capabilities.TimerCount; i++) {
 
     // Register remaining counters
@@ -224,6 +269,18 @@ PRIVATE int hpet_init() {
 
       HPET_TimerState *tState = &timers[i];
       tState->hpet = base_addr;
+      tState->enabled = false;
+      tState->percpu = false;
+      tState->cpu = -1;
+      tState->vector = 0;
+      tState->cur_handler = NULL;
+
+      // Left for hpet_clockevent_claim, never shared through timer_request
+      if (percpu && base_addr->timers[i].Configuration.FSBInterruptDelivery) {
+        tState->percpu = true;
+        base_addr->timers[i].Configuration.InterruptEnable = 0;
+        continue;
+      }
 
       // Configure MSI information
       if (base_addr->timers[i].Configuration.FSBInterruptDelivery) {
@@ -231,11 +288,12 @@ PRIVATE int hpet_init() {
 
         base_addr->timers[i].Configuration.FSBInterruptEnable = 1;
         base_addr->timers[i].InterruptRoute.Address =
-            msi_register_addr(interrupt_get_cpuidx());
+            msi_register_addr(interrupt_gettarget(intrpt_num));
         base_addr->timers[i].InterruptRoute.Value =
             msi_register_data(intrpt_num);
       } else {
         sub_features |= timer_features_fixed_intr;
+        fsb_only = false;
 
         // All hpet timers use the same interrupt vector
         // Try to configure all timers to use the same ioapic line
@@ -277,8 +335,110 @@ PRIVATE int hpet_init() {
     }
   }
 
-  // Enable the counter
-  base_addr->Configuration.GlobalEnable = 0;
+  // Timers routed through the IOAPIC are moved by its retarget hook instead
+  if (fsb_only)
+    interrupt_setretarget(intrpt_num, hpet_retarget);
 
   return 0;
+}
+
+PRIVATE uint64_t hpet_getrate() {
+  if (hpet_main == NULL)
+    return 0;
+  return 1000000000000000 / (uint64_t)hpet_main->Capabilities.ClockPeriod;
+}
+
+PRIVATE uint64_t hpet_readcounter() { return hpet_main->CounterValue; }
+
+// Take a reserved comparator as the calling core's clock event, delivered
+// over FSB straight to this core on a vector from its own space.
+PRIVATE int hpet_clockevent_claim(void (*handler)(int)) {
+  // A 32-bit main counter wraps every ~300s, taking the tick clock back
+  if (hpet_main == NULL || timers == NULL || !hpet_main->Capabilities.Is64Bit)
+    return -1;
+
+  int cpu = interrupt_get_cpunum();
+  int idx = -1;
+
+  local_spinlock_lock(&hpet_claim_lock);
+  for (int i = 0; i <= hpet_main->Capabilities.TimerCount; i++) {
+    if (!timers[i].percpu)
+      continue;
+    if (timers[i].cpu == cpu) {
+      idx = i;
+      break;
+    }
+    if (timers[i].cpu < 0 && idx < 0)
+      idx = i;
+  }
+  if (idx >= 0)
+    timers[idx].cpu = cpu;
+  local_spinlock_unlock(&hpet_claim_lock);
+
+  if (idx < 0)
+    return -1;
+
+  HPET_TimerState *tState = &timers[idx];
+  if (tState->vector == 0) {
+    int vec = 0;
+    if (interrupt_allocate_local(cpu, 1, interrupt_flags_timer, &vec) != 0) {
+      tState->cpu = -1;
+      return -1;
+    }
+    interrupt_registerhandler_local(cpu, vec, handler);
+    tState->vector = vec;
+  }
+
+  HPET_Timer *t = &hpet_main->timers[idx];
+  t->Configuration.InterruptEnable = 0;
+  t->Configuration.TimerType = 0;
+  t->Configuration.InterruptType = 0;
+  t->Configuration.FSBInterruptEnable = 1;
+  t->InterruptRoute.Address = msi_register_addr(interrupt_get_cpuidx());
+  t->InterruptRoute.Value = msi_register_data(tState->vector);
+  tState->enabled = true;
+
+  return idx;
+}
+
+// Fire the clock event when the main counter reaches cnt, ~0 disables it.
+// A deadline the counter already passed is raised as a self IPI since the
+// comparator only matches on equality.
+PRIVATE void hpet_clockevent_program(int idx, uint64_t cnt) {
+  HPET_Timer *t = &hpet_main->timers[idx];
+  if (cnt == ~0ull) {
+    t->Configuration.InterruptEnable = 0;
+    return;
+  }
+
+  // Keep within half the wrap of a 32-bit comparator
+  uint64_t now = hpet_main->CounterValue;
+  if ((int64_t)(cnt - now) > 0x7fffffff)
+    cnt = now + 0x7fffffff;
+
+  t->ComparatorValue = cnt;
+  t->Configuration.InterruptEnable = 1;
+
+  if ((int64_t)(hpet_main->CounterValue - cnt) >= 0)
+    interrupt_sendipi(interrupt_get_cpuidx(), timers[idx].vector,
+                      ipi_delivery_mode_fixed);
+}
+
+// Tsc ticks per second, measured over ms of the main counter
+PRIVATE uint64_t hpet_calibrate_tsc(uint32_t ms) {
+  if (hpet_main == NULL)
+    return 0;
+
+  uint64_t rate =
+      1000000000000000 / (uint64_t)hpet_main->Capabilities.ClockPeriod;
+  uint64_t ticks = rate * ms / 1000;
+
+  uint64_t h0 = hpet_main->CounterValue;
+  uint64_t t0 = rdtsc();
+  uint64_t h1 = h0;
+  while (h1 - h0 < ticks)
+    h1 = hpet_main->CounterValue;
+  uint64_t t1 = rdtsc();
+
+  return (t1 - t0) * rate / (h1 - h0);
 }
\ No newline at end of file
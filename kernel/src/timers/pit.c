@@ -5,4 +5,38 @@
  * https://opensource.org/licenses/MIT
  */
 
-int pit_init() { return -1; }
\ No newline at end of file
+#include "stdint.h"
+#include "types.h"
+
+#include "priv_timers.h"
+
+#define PIT_FREQ (1193182)
+
+int pit_init() { return -1; }
+
+// Ticks per second of read, measured over a channel 2 countdown of ms (at
+// most 54ms). Channel 2 is gated through port 0x61 and needs no interrupt.
+PRIVATE uint64_t pit_calibrate(uint32_t ms, uint64_t (*read)(void)) {
+  uint32_t cnt = PIT_FREQ * ms / 1000;
+
+  // Gate high, speaker off
+  outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+
+  // Channel 2, lobyte/hibyte, mode 0 (interrupt on terminal count)
+  outb(0x43, 0xB0);
+  outb(0x42, cnt & 0xff);
+  outb(0x42, (cnt >> 8) & 0xff);
+
+  uint64_t t0 = read();
+  while ((inb(0x61) & 0x20) == 0)
+    ;
+  uint64_t t1 = read();
+
+  return (t1 - t0) * 1000 / ms;
+}
+
+static uint64_t pit_readtsc(void) { return rdtsc(); }
+
+PRIVATE uint64_t pit_calibrate_tsc(uint32_t ms) {
+  return pit_calibrate(ms, pit_readtsc);
+}
\ No newline at end of file
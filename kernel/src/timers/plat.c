@@ -14,7 +14,8 @@
 #include "timer.h"
 
 int timer_platform_gettimercount() {
-  return hpet_getcount() + (use_tsc() ? 2 : 0) + 2;
+  // hpet main counter and comparators, tsc, apic and rtc
+  return hpet_getcount() + 3;
 }
 
 int timer_platform_init() {
@@ -23,6 +24,19 @@ int timer_platform_init() {
   outb(0x40, 0x00);
   outb(0x40, 0x00);
 
+  timepage_init();
+
+  // Initialize HPET timer - also the reference for calibrating the TSC
+  if (hpet_init() != 0)
+    pit_init();
+
+  if (tsc_calibrate() != 0)
+    print_str("TSC Calibration Failed.\r\n");
+
+  // Without a usable TSC, FSB capable HPET comparators become per-core
+  // deadline timers
+  hpet_comparators_init(!use_tsc());
+
   // If TSC timer is constant rate + consistent and the rate is known, just use
   // APIC timer in TSC mode
   if (use_tsc()) {
@@ -32,18 +46,14 @@ int timer_platform_init() {
   } else {
     print_str("TSC Unusable\r\n");
 
-    // Initialize HPET timer - use as reference
-    if (hpet_init() != 0) {
-      // Initialize PIT timer - use as reference if HPET is not available
-      pit_init();
-    }
     // Initialize APIC timer as a periodic timer
     apic_timer_init();
   }
 
-  // Initialize RTC timer - absolute timer/clock
-  rtc_init();
+  clocksource_select();
 
+  // Initialize RTC timer - absolute timer/clock, based off the clocksource
+  rtc_init();
   return 0;
 }
 
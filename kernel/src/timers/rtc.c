@@ -8,8 +8,11 @@
 #include "stddef.h"
 #include "stdint.h"
 #include "stdlib.h"
+#include "string.h"
 #include "types.h"
 
+#include "debug.h"
+
 #include "interrupts.h"
 #include "priv_timers.h"
 #include "timer.h"
@@ -26,41 +29,79 @@
 #define STATUS_B 0x0B
 #define BIN_FROM_BCD(bcd) (((bcd / 16) * 10) + (bcd & 0xf))
 
-static uint8_t century = 0, year = 0, month = 0, dayofmonth = 0, weekday = 0,
-               hours = 0, minutes = 0, seconds = 0;
-static uint64_t ms_10000000x = 0, ms_sinceboot = 0;
-
-static uint8_t rtc_read(uint8_t off) {
+// Calendar read at boot, as epoch seconds
+static uint64_t rtc_boot_epoch = 0;
+// Update-ended interrupts seen since the last resync
+static uint64_t rtc_updates = 0;
+static uint64_t rtc_sync_epoch = 0;
+static bool rtc_synced = false;
+
+// Raw accessors, callers hold the device priority across a whole sequence.
+// Only the RTC interrupt itself shares the index register, so timers and IPIs
+// can still be taken meanwhile.
+static uint8_t rtc_rawread(uint8_t off) {
+  outb(0x70, (1 << 7) | off);
+  return inb(0x71);
+}
 
-  int state = cli();
+static void rtc_rawwrite(uint8_t off, uint8_t val) {
   outb(0x70, (1 << 7) | off);
-  uint8_t val = inb(0x71);
-  sti(state);
+  outb(0x71, val);
+}
 
+static uint8_t rtc_read(uint8_t off) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  uint8_t val = rtc_rawread(off);
+  interrupt_lowerpriority(prio);
   return val;
 }
 
 static void rtc_write(uint8_t off, uint8_t val) {
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  rtc_rawwrite(off, val);
+  interrupt_lowerpriority(prio);
+}
 
-  int state = cli();
-  outb(0x70, (1 << 7) | off);
-  outb(0x71, val);
-  sti(state);
+static const uint8_t rtc_regs[] = {SECONDS, MINUTES,    HOURS,
+                                   WEEKDAY, DAYOFMONTH, MONTH,
+                                   YEAR,    CENTURY,    STATUS_B};
+#define RTC_REG_CNT (sizeof(rtc_regs) / sizeof(rtc_regs[0]))
+
+static void rtc_readregs(uint8_t *rtc_data) {
+  // An update holds UIP for under 2ms, never wait for one to begin
+  while (rtc_rawread(STATUS_A) & 0x80)
+    __asm__ volatile("pause");
+
+  for (uint32_t i = 0; i < RTC_REG_CNT; i++)
+    rtc_data[rtc_regs[i]] = rtc_rawread(rtc_regs[i]);
 }
 
-static void rtc_gettime(uint8_t *century, uint8_t *year, uint8_t *month,
-                        uint8_t *dayofmonth, uint8_t *weekday, uint8_t *hours,
-                        uint8_t *minutes, uint8_t *seconds) {
+// Seconds since 1970-01-01 for a UTC date
+static uint64_t rtc_toepoch(uint64_t y, uint64_t m, uint64_t d, uint64_t h,
+                            uint64_t min, uint64_t s) {
+  // Count years from March so the leap day falls at the end
+  if (m <= 2) {
+    y--;
+    m += 12;
+  }
+  uint64_t days = 365 * y + y / 4 - y / 100 + y / 400 + (153 * (m - 3) + 2) / 5 +
+                  d - 719469;
+  return ((days * 24 + h) * 60 + min) * 60 + s;
+}
 
-  while ((rtc_read(STATUS_A) & 0x80) != 0x80)
-    ; // Wait for update in progress bit to be set
-  while ((rtc_read(STATUS_A) & 0x80) == 0x80)
-    ; // Wait for update in progress bit to be clear
+// Read the calendar as epoch seconds. Reads are repeated until two agree so
+// an update landing mid read can't tear the result.
+static uint64_t rtc_gettime(void) {
+  uint8_t rtc_data[CENTURY + 1];
+  uint8_t prev[CENTURY + 1];
 
-  // Read the time
-  uint8_t rtc_data[64];
-  for (uint8_t i = 0; i < 64; i++)
-    rtc_data[i] = rtc_read(i);
+  int prio = interrupt_raisepriority(interrupt_priority_device);
+  rtc_readregs(rtc_data);
+  do {
+    memcpy(prev, rtc_data, sizeof(rtc_data));
+    rtc_readregs(rtc_data);
+  } while (memcmp(prev, rtc_data, sizeof(rtc_data)) != 0);
+  interrupt_lowerpriority(prio);
 
   // Determine the format of the rtc
   bool _24hr = (rtc_data[STATUS_B] & 2);
@@ -85,85 +126,74 @@ static void rtc_gettime(uint8_t *century, uint8_t *year, uint8_t *month,
   }
 
   if (!_24hr && pm) {
-    rtc_data[HOURS] += 12;
+    rtc_data[HOURS] = (rtc_data[HOURS] % 12) + 12;
+  } else if (!_24hr && rtc_data[HOURS] == 12) {
+    rtc_data[HOURS] = 0;
   }
 
-  *century = rtc_data[CENTURY];
-  *year = rtc_data[YEAR];
-  *month = rtc_data[MONTH];
-  *dayofmonth = rtc_data[DAYOFMONTH];
-  *weekday = rtc_data[WEEKDAY];
-  *hours = rtc_data[HOURS];
-  *minutes = rtc_data[MINUTES];
-  *seconds = rtc_data[SECONDS];
+  uint64_t century = CURRENT_YEAR / 100;
+  return rtc_toepoch(century * 100 + rtc_data[YEAR], rtc_data[MONTH],
+                     rtc_data[DAYOFMONTH], rtc_data[HOURS], rtc_data[MINUTES],
+                     rtc_data[SECONDS]);
 }
 
+// Fires as each second ends. The first one lines the wall clock up with the
+// second boundary, later ones slew out drift between the RTC and the
+// clocksource.
 static void rtc_interrupt(int int_num) {
   int_num = 0;
 
   uint8_t int_mask = rtc_read(0x0C);
-  if (int_mask & 0x40)
-    ms_10000000x += 9765625; // increment by the period of the interrupt
-  if (ms_10000000x >= 10000000000) {
-    seconds++;
-    ms_10000000x -= 10000000000;
-    ms_sinceboot++;
-  }
-  if (seconds >= 60) {
-    seconds -= 60;
-    minutes++;
-  }
-  if (minutes >= 60) {
-    minutes -= 60;
-    hours++;
-  }
-  if (hours >= 24) {
-    hours -= 24;
-    weekday = (weekday + 1) % 7;
-    dayofmonth++;
-  }
-  if (dayofmonth >= 31) {
-    dayofmonth -= 31;
-    month++;
-  }
-  if (month >= 12) {
-    month -= 12;
-    year++;
-  }
-  if (year >= 100) {
-    year -= 100;
-    century++;
+  if (!(int_mask & 0x10))
+    return;
+
+  uint64_t now = clock_monotonic_ns();
+  rtc_updates++;
+  uint64_t expected = (rtc_sync_epoch + rtc_updates) * 1000000000ull;
+  int64_t err = (int64_t)(expected - (now + clock_getrealtime()));
+
+  if (!rtc_synced || err > 1000000000ll || err < -1000000000ll) {
+    clock_setrealtime(expected - now);
+    rtc_synced = true;
+  } else {
+    clock_setrealtime(clock_getrealtime() + err / 16);
   }
-  // TODO: Fix the time update routine
 }
 
 static uint64_t rtc_readtime(timer_handlers_t *t) {
   t = NULL;
-  return ms_sinceboot;
+  return clock_realtime_ns() / 1000000000ull;
+}
+
+// Read the calendar again and restart drift tracking from it
+void rtc_resync(void) {
+  uint64_t epoch = rtc_gettime();
+  rtc_sync_epoch = epoch;
+  rtc_updates = 0;
+  rtc_synced = false;
+
+  // Close enough until the next update interrupt pins the second boundary
+  clock_setrealtime(epoch * 1000000000ull - clock_monotonic_ns());
 }
 
 PRIVATE int rtc_init() {
-  // Read the start time and setup a periodic interrupt to maintain system time
-  // in ms
-  rtc_gettime(&century, &year, &month, &dayofmonth, &weekday, &hours, &minutes,
-              &seconds);
-  century = CURRENT_YEAR / 100;
-
-  // The read is guaranteed to start at ms = 0, thus start the periodic
-  // interrupt
+  rtc_resync();
+  rtc_boot_epoch = rtc_sync_epoch;
+
+  // Update-ended interrupts at 1Hz keep the wall clock in step
   int irq = 8 + 32;
   if (interrupt_allocate(1, interrupt_flags_fixed, &irq) == 0) {
     interrupt_registerhandler(irq, rtc_interrupt);
-    rtc_write(STATUS_B, rtc_read(STATUS_B) | 0x40);
+    rtc_write(STATUS_B, (rtc_read(STATUS_B) & ~0x40) | 0x10);
+    rtc_read(0x0C);
 
-    // Register a read only realtime timer
+    // Register a read only realtime timer, in epoch seconds
     timer_handlers_t main_counter = {.name = "rtc"};
-    timer_features_t main_features = timer_features_persistent |
-                                     timer_features_counter |
-                                     timer_features_read;
-    // TODO: Compute and add timer_features_absolute for real world time
+    timer_features_t main_features =
+        timer_features_persistent | timer_features_counter |
+        timer_features_read | timer_features_absolute;
 
-    main_counter.rate = 1000;
+    main_counter.rate = 1;
     main_counter.read = rtc_readtime;
     main_counter.write = NULL;
     main_counter.set_mode = NULL;
@@ -176,4 +206,22 @@ PRIVATE int rtc_init() {
   }
 
   return -1;
-}
\ No newline at end of file
+}
+
+#ifdef BENCHMARK
+#define RTC_BENCH_READS (16)
+
+// Cycles for a full calendar read, what resyncing and boot pay
+void rtc_benchmark(void) {
+  uint64_t start = rdtsc();
+  for (int i = 0; i < RTC_BENCH_READS; i++)
+    rtc_gettime();
+  uint64_t cycles = (rdtsc() - start) / RTC_BENCH_READS;
+
+  print_str("RTC calendar read cycles: ");
+  print_uint64(cycles, BASE_HEX);
+  print_str(" boot epoch: ");
+  print_uint64(rtc_boot_epoch, BASE_HEX);
+  print_str("\r\n");
+}
+#endif
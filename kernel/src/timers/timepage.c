@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "string.h"
+#include "types.h"
+
+#include "debug.h"
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "memory.h"
+#include "priv_timers.h"
+#include "timepage.h"
+#include "timer.h"
+
+static intptr_t timepage_phys = 0;
+static volatile time_page_t *timepage = NULL;
+static int timepage_lock = 0;
+
+PRIVATE void timepage_init() {
+  timepage_phys = pmem_allocpage();
+  if (timepage_phys == 0)
+    PANIC("Time page allocation failure!");
+
+  timepage = (volatile time_page_t *)vmem_phystovirt(
+      timepage_phys, KiB(4), vmem_flags_cachewriteback | vmem_flags_kernel);
+  memset((void *)timepage, 0, KiB(4));
+}
+
+intptr_t timepage_getphys(void) { return timepage_phys; }
+
+static void timepage_begin(void) {
+  local_spinlock_lock(&timepage_lock);
+  __atomic_store_n(&timepage->seq, timepage->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void timepage_end(void) {
+  __atomic_store_n(&timepage->seq, timepage->seq + 1, __ATOMIC_RELEASE);
+  local_spinlock_unlock(&timepage_lock);
+}
+
+// Publish the clocksource scale, a mode of none sends readers to the kernel
+PRIVATE void timepage_setclock(time_page_mode_t mode, uint64_t mult,
+                               uint32_t shift, uint64_t base_cnt,
+                               uint64_t base_ns) {
+  if (timepage == NULL)
+    return;
+
+  int state = cli();
+  timepage_begin();
+  timepage->mode = mode;
+  timepage->mult = mult;
+  timepage->shift = shift;
+  timepage->base_cnt = base_cnt;
+  timepage->base_ns = base_ns;
+  timepage_end();
+  sti(state);
+}
+
+PRIVATE void timepage_setrealtime(uint64_t realtime_ns) {
+  if (timepage == NULL)
+    return;
+
+  int state = cli();
+  timepage_begin();
+  timepage->realtime_ns = realtime_ns;
+  timepage_end();
+  sti(state);
+}
+
+#ifdef BENCHMARK
+#define TIMEPAGE_BENCH_READS (10000)
+#define TIMEPAGE_BENCH_SWVEC (0x82)
+
+static volatile uint64_t timepage_bench_val = 0;
+
+static void timepage_bench_trap(int irq) {
+  irq = 0;
+  timepage_bench_val = clock_monotonic_ns();
+}
+
+// Cycles per clock read through the time page against a trap into the
+// kernel, the closest thing to a syscall until user mode exists.
+void timepage_benchmark(void) {
+  uint64_t ns = 0;
+  if (!timepage_monotonic_ns(timepage, &ns)) {
+    print_str("Time page has no direct clock.\r\n");
+    return;
+  }
+
+  uint64_t start = rdtsc();
+  for (int i = 0; i < TIMEPAGE_BENCH_READS; i++)
+    timepage_monotonic_ns(timepage, &ns);
+  uint64_t page_cost = (rdtsc() - start) / TIMEPAGE_BENCH_READS;
+
+  int vec = TIMEPAGE_BENCH_SWVEC;
+  if (interrupt_allocate(1, interrupt_flags_exclusive | interrupt_flags_fixed,
+                         &vec) != 0) {
+    print_str("Time page benchmark: trap vector in use.\r\n");
+    return;
+  }
+  interrupt_registerhandler(vec, timepage_bench_trap);
+
+  start = rdtsc();
+  for (int i = 0; i < TIMEPAGE_BENCH_READS; i++)
+    __asm__ volatile("int %0" ::"i"(TIMEPAGE_BENCH_SWVEC) : "memory");
+  uint64_t trap_cost = (rdtsc() - start) / TIMEPAGE_BENCH_READS;
+
+  interrupt_unregisterhandler(vec, timepage_bench_trap);
+  interrupt_free(vec, 1);
+
+  print_str("Time page read cycles: ");
+  print_uint64(page_cost, BASE_HEX);
+  print_str(" trap read cycles: ");
+  print_uint64(trap_cost, BASE_HEX);
+  print_str("\r\n");
+}
+#endif
@@ -39,67 +39,20 @@ PRIVATE int timer_register(timer_features_t features,
   return timer_idx++;
 }
 
-// TODO Figure out how to handle smp timer usage
-static _Atomic int timer_wait_pending = 0;
-static _Atomic int timer_wait_count = 0;
-static _Atomic int timer_wait_target = 0;
-static timer_defs_t *timer_wait_d = NULL;
-PRIVATE void timer_wait_handler(int irq) {
-  irq = 0;
-  if (++timer_wait_count >= timer_wait_target && timer_wait_pending != 0) {
-    DEBUG_PRINT("Timer Wait Done\r\n");
-    timer_wait_pending = 0;
-  }
-}
-
-void timer_wait(uint64_t ns) {
-
-  // Allocate a timer for oneshot mode with a rate that can match the desired
-  // time
-  int idx = 0;
-  for (; idx < timer_idx; idx++)
-    if (!timer_defs[idx].in_use &&
-        timer_defs[idx].features & timer_features_periodic) {
-
-      if (timer_defs[idx].handlers.set_mode != NULL &&
-          timer_defs[idx].handlers.set_handler != NULL &&
-          timer_defs[idx].handlers.set_enable != NULL)
-        break;
-    }
-  if (idx == timer_idx)
-    PANIC("Failed to select timer.");
-
-  timer_wait_count = 0;
-  timer_wait_pending = 1;
-  DEBUG_PRINT("Timer wait start! ");
-
-  // Configure it for oneshot wait handler
-  timer_defs_t *t = &timer_defs[idx];
-  timer_wait_d = t;
-
-  timer_wait_target = ns / (1000000000 / t->handlers.rate);
-
-  if (timer_wait_target == 0)
-    timer_wait_target = 1;
-
-  print_str("Allocated one-shot timer: ");
-  print_str(t->handlers.name);
-
-  t->in_use = true;
-  // t->handlers.set_mode(&t->handlers, timer_features_oneshot);
-  t->handlers.set_handler(&t->handlers, timer_wait_handler);
-  t->handlers.set_enable(&t->handlers, true);
-
-  // Halt the cpu
-  while (timer_wait_pending)
-    halt();
-
-  t->handlers.set_enable(&t->handlers, false);
+// Fetch a registered timer, returns -1 past the last one
+PRIVATE int timer_getcounter(int idx, timer_features_t *features,
+                             timer_handlers_t **handlers) {
+  if (idx < 0 || idx >= timer_idx)
+    return -1;
 
-  DEBUG_PRINT("Timer Finish\r\n");
+  *features = timer_defs[idx].features;
+  *handlers = &timer_defs[idx].handlers;
+  return 0;
+}
 
-  timer_wait_d = NULL;
-  t->in_use = false;
+PRIVATE void timer_clearfeatures(int idx, timer_features_t features) {
+  if (idx >= 0 && idx < timer_idx)
+    timer_defs[idx].features &= ~features;
 }
 
 int timer_request(timer_features_t features, uint64_t ns,
@@ -128,7 +81,6 @@ int timer_request(timer_features_t features, uint64_t ns,
 
   // Configure the timer
   timer_defs_t *t = &timer_defs[idx];
-  timer_wait_d = t;
   t->in_use = true;
   t->handlers.set_mode(&t->handlers, features);
   if (features & timer_features_write)
@@ -17,7 +17,6 @@ PRIVATE bool use_tsc() {
   bool tsc_deadline = get_cpuid()->tsc_deadline;
   bool tsc_invar = get_cpuid()->tsc_invar;
   uint64_t tsc_freq = get_cpuid()->tsc_freq;
-  uint64_t apic_freq = get_cpuid()->apic_freq;
 
 /*
   if (tsc_valid) print_str("TSC Exists.\r\n");
@@ -25,22 +24,50 @@ PRIVATE bool use_tsc() {
   if (tsc_invar) print_str("TSC is invariant.\r\n");
   print_str("TSC Frequency: ");
   print_uint64(tsc_freq, BASE_HEX);
-  print_str("\r\nAPIC Frequency: ");
-  print_uint64(apic_freq, BASE_HEX);
   print_str("\r\n");
 */
 
-  // return true;
-  return (tsc_valid && tsc_deadline && tsc_invar && tsc_freq != 0 &&
-          apic_freq != 0);
+  // The frequency is calibrated at boot when CPUID doesn't report it
+  return (tsc_valid && tsc_invar && tsc_freq != 0);
+}
+
+#define TSC_CALIBRATE_MS (10)
+#define TSC_CALIBRATE_RUNS (3)
+
+// Measure the tsc rate against the HPET, or the PIT without one. The
+// shortest of a few runs is kept since SMIs only ever stretch a run.
+PRIVATE int tsc_calibrate() {
+  if (!get_cpuid()->tsc_valid)
+    return -1;
+  if (get_cpuid()->tsc_freq != 0)
+    return 0;
+
+  uint64_t best = 0;
+  for (int i = 0; i < TSC_CALIBRATE_RUNS; i++) {
+    int state = cli();
+    uint64_t freq = hpet_calibrate_tsc(TSC_CALIBRATE_MS);
+    if (freq == 0)
+      freq = pit_calibrate_tsc(TSC_CALIBRATE_MS);
+    sti(state);
+
+    if (best == 0 || freq < best)
+      best = freq;
+  }
+
+  if (best == 0)
+    return -1;
+
+  print_str("TSC Calibrated Frequency: ");
+  print_uint64(best, BASE_HEX);
+  print_str("\r\n");
+
+  get_cpuid()->tsc_freq = best;
+  return 0;
 }
 
 PRIVATE uint64_t tsc_read(timer_handlers_t *handlers) {
   handlers = NULL;
-
-  uint64_t edx = 0, eax = 0;
-  __asm__ volatile("rdtsc" : "=d"(edx), "=a"(eax));
-  return (edx << 32) | (eax & 0xffffffff);
+  return tsc_local();
 }
 
 PRIVATE int tsc_init() {
@@ -55,7 +82,9 @@ PRIVATE int tsc_init() {
     timer_handlers_t main_counter = {.name = "tsc"};
     timer_features_t main_features = timer_features_persistent |
                                      timer_features_counter |
-                                     timer_features_read;
+                                     timer_features_read | timer_features_64bit;
+    if (get_cpuid()->tsc_invar)
+      main_features |= timer_features_stable;
 
     // strncpy(main_counter.name, "tsc", 16);
     main_counter.rate = get_cpuid()->tsc_freq;
@@ -69,7 +98,7 @@ PRIVATE int tsc_init() {
   }
 
   // Initialize the apic timer
-  return apic_timer_init(); // TODO: May want to use the TSC deadline mode
+  return apic_timer_init(); // Tickless mode runs off the TSC deadline
 }
 
 PRIVATE int tsc_mp_init() {
@@ -80,5 +109,5 @@ PRIVATE int tsc_mp_init() {
   __asm__ volatile("mov %0, %%cr4" ::"r"(cr4));
 
   // Initialize the apic timer
-  return apic_timer_init(); // TODO: May want to use the TSC deadline mode
+  return apic_timer_init(); // Tickless mode runs off the TSC deadline
 }
\ No newline at end of file
@@ -0,0 +1,246 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "types.h"
+
+#include "cpuid.h"
+#include "debug.h"
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "priv_timers.h"
+#include "thread.h"
+#include "timer.h"
+
+#define IA32_TSC_ADJUST (0x3b)
+#define TSC_SYNC_ROUNDS (64)
+#define TSC_WARP_ITERS (100000) // per core, all cores run at once
+#define TSC_WARP_SHARDS (16)
+#define TSC_WARP_PER_SHARD (4) // cores contending on each shard
+
+typedef enum {
+  tsc_sync_ping,
+  tsc_sync_adjust,
+  tsc_sync_warp,
+  tsc_sync_done,
+} tsc_sync_cmd_t;
+
+// Per AP rendezvous with the BSP. The BSP posts a command by bumping seq, the
+// AP acknowledges with the same value.
+typedef struct {
+  tsc_sync_cmd_t cmd;
+  _Atomic uint64_t seq;
+  _Atomic uint64_t ack;
+  uint64_t ap_tsc;
+  int64_t offset; // ap - bsp, for the AP to remove
+  int idx;        // warp test participant index
+  uint64_t warp;  // worst warp this core saw
+} ALIGNED(64) tsc_slot_t;
+
+// The warp test spreads its cross core reads over a few shards so every core
+// can run its full count at once without all of them queueing on one line.
+typedef struct {
+  int lock;
+  uint64_t last;
+} ALIGNED(64) tsc_warp_shard_t;
+
+static tsc_slot_t tsc_slots[MAX_CPU_COUNT];
+static tsc_warp_shard_t warp_shards[TSC_WARP_SHARDS];
+static int warp_nshards = 1;
+
+int64_t tsc_offsets[MAX_CPU_COUNT];
+bool tsc_sw_offsets = false;
+
+// Largest skew the TSC may show between cores and still be the clocksource
+static uint64_t tsc_maxskew(void) { return get_cpuid()->tsc_freq / 1000000; }
+
+static bool tsc_sync_enabled(void) {
+  return get_cpuid()->tsc_valid && get_cpuid()->tsc_freq != 0;
+}
+
+PRIVATE uint64_t tsc_local(void) {
+  if (!tsc_sw_offsets)
+    return rdtsc();
+
+  // The offset must be the one of the core the read happened on
+  preempt_disable();
+  uint64_t tsc = rdtsc() - tsc_offsets[interrupt_get_cpunum()];
+  preempt_enable();
+  return tsc;
+}
+
+// Each read is ordered after the previous one on the same shard by its lock,
+// so it must not be smaller no matter which core made the previous one.
+static uint64_t tsc_warp_run(int idx) {
+  uint64_t warp = 0;
+  for (int i = 0; i < TSC_WARP_ITERS; i++) {
+    tsc_warp_shard_t *shard = &warp_shards[(idx + i) % warp_nshards];
+    local_spinlock_lock(&shard->lock);
+    uint64_t prev = shard->last;
+    uint64_t now = tsc_local();
+    shard->last = now;
+    local_spinlock_unlock(&shard->lock);
+    if (now < prev && prev - now > warp)
+      warp = prev - now;
+  }
+  return warp;
+}
+
+static void tsc_apply(int64_t offset) {
+  if (get_cpuid()->tsc_adjust) {
+    wrmsr(IA32_TSC_ADJUST, rdmsr(IA32_TSC_ADJUST) - offset);
+  } else {
+    tsc_offsets[interrupt_get_cpunum()] += offset;
+    tsc_sw_offsets = true;
+  }
+}
+
+// Runs on the AP early in bring up, serving the BSP's commands
+void tsc_sync_ap(void) {
+  if (!tsc_sync_enabled())
+    return;
+
+  tsc_slot_t *slot = &tsc_slots[interrupt_get_cpunum()];
+  uint64_t seen = 0;
+
+  while (true) {
+    uint64_t seq;
+    while ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) == seen)
+      __asm__ volatile("pause");
+    seen = seq;
+
+    tsc_sync_cmd_t cmd = slot->cmd;
+    switch (cmd) {
+    case tsc_sync_ping:
+      slot->ap_tsc = tsc_local();
+      break;
+    case tsc_sync_adjust:
+      tsc_apply(slot->offset);
+      break;
+    case tsc_sync_warp:
+      slot->warp = tsc_warp_run(slot->idx);
+      break;
+    case tsc_sync_done:
+      break;
+    }
+
+    __atomic_store_n(&slot->ack, seq, __ATOMIC_RELEASE);
+    if (cmd == tsc_sync_done)
+      return;
+  }
+}
+
+static uint64_t tsc_sync_post(tsc_slot_t *slot, tsc_sync_cmd_t cmd) {
+  slot->cmd = cmd;
+  return __atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+}
+
+static void tsc_sync_wait(tsc_slot_t *slot, uint64_t seq) {
+  while (__atomic_load_n(&slot->ack, __ATOMIC_ACQUIRE) != seq)
+    __asm__ volatile("pause");
+}
+
+// Estimate the AP's offset from the ping with the shortest round trip, the
+// AP's read happened somewhere inside it so half of it bounds the error.
+static int64_t tsc_measure(tsc_slot_t *slot, uint64_t *err) {
+  uint64_t best_rtt = ~0ull;
+  int64_t best = 0;
+
+  for (int i = 0; i < TSC_SYNC_ROUNDS; i++) {
+    uint64_t t0 = tsc_local();
+    uint64_t seq = tsc_sync_post(slot, tsc_sync_ping);
+    tsc_sync_wait(slot, seq);
+    uint64_t t2 = tsc_local();
+
+    if (t2 - t0 < best_rtt) {
+      best_rtt = t2 - t0;
+      best = (int64_t)(slot->ap_tsc - (t0 + (t2 - t0) / 2));
+    }
+  }
+
+  *err = best_rtt / 2;
+  return best;
+}
+
+static uint64_t tsc_abs(int64_t v) { return v < 0 ? -v : v; }
+
+// Runs on the BSP once the APs in cpus (bit n is cpunum n) are all waiting in
+// tsc_sync_ap. Each AP's offset is measured with a short ping exchange and
+// removed through IA32_TSC_ADJUST, or a software offset without it. Then every
+// core runs the warp test at once, checking that reads bouncing between them
+// never go backwards. If the skew can't be bounded the TSC stops being the
+// clocksource.
+void tsc_sync_bsp(uint64_t cpus) {
+  if (!tsc_sync_enabled() || cpus == 0)
+    return;
+
+  int state = cli();
+
+  uint64_t worst = 0;
+  int cnt = 1;
+  for (int cpu = 0; cpu < MAX_CPU_COUNT; cpu++) {
+    if (!(cpus & (1ull << cpu)))
+      continue;
+    tsc_slot_t *slot = &tsc_slots[cpu];
+
+    uint64_t err = 0;
+    int64_t offset = tsc_measure(slot, &err);
+    if (tsc_abs(offset) > err) {
+      slot->offset = offset;
+      tsc_sync_wait(slot, tsc_sync_post(slot, tsc_sync_adjust));
+      offset = tsc_measure(slot, &err);
+    }
+
+    print_str("[Core: ");
+    print_int32(cpu, BASE_HEX);
+    print_str("] TSC skew: ");
+    print_uint64(tsc_abs(offset), BASE_HEX);
+    print_str(" +/- ");
+    print_uint64(err, BASE_HEX);
+    print_str("\r\n");
+
+    if (tsc_abs(offset) > err && tsc_abs(offset) - err > worst)
+      worst = tsc_abs(offset) - err;
+    slot->idx = cnt++;
+  }
+
+  warp_nshards = cnt / TSC_WARP_PER_SHARD;
+  if (warp_nshards < 1)
+    warp_nshards = 1;
+  if (warp_nshards > TSC_WARP_SHARDS)
+    warp_nshards = TSC_WARP_SHARDS;
+
+  for (int cpu = 0; cpu < MAX_CPU_COUNT; cpu++)
+    if (cpus & (1ull << cpu))
+      tsc_sync_post(&tsc_slots[cpu], tsc_sync_warp);
+  uint64_t warp = tsc_warp_run(0);
+  for (int cpu = 0; cpu < MAX_CPU_COUNT; cpu++) {
+    if (!(cpus & (1ull << cpu)))
+      continue;
+    tsc_slot_t *slot = &tsc_slots[cpu];
+    tsc_sync_wait(slot, __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+    if (slot->warp > warp)
+      warp = slot->warp;
+    tsc_sync_wait(slot, tsc_sync_post(slot, tsc_sync_done));
+  }
+
+  sti(state);
+
+  print_str("TSC warp: ");
+  print_uint64(warp, BASE_HEX);
+  print_str(" over ");
+  print_int32(cnt, BASE_HEX);
+  print_str(" cores\r\n");
+
+  if (warp > tsc_maxskew() || worst > tsc_maxskew()) {
+    print_str("TSC skew unbounded, falling back.\r\n");
+    clocksource_unstable("tsc");
+  } else if (tsc_sw_offsets) {
+    clocksource_publish();
+  }
+}
@@ -0,0 +1,380 @@
+/**
+ * Copyright (c) 2019 Himanshu Goel
+ *
+ * This software is released under the MIT License.
+ * https://opensource.org/licenses/MIT
+ */
+
+#include "stddef.h"
+#include "stdint.h"
+#include "stdlib.h"
+#include "string.h"
+#include "types.h"
+
+#include "debug.h"
+#include "interrupts.h"
+#include "local_spinlock.h"
+#include "priv_timers.h"
+#include "timer.h"
+
+#define WHEEL_BITS (6)
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS (5)
+#define WHEEL_RANGE (1ull << (WHEEL_BITS * WHEEL_LEVELS))
+#define WHEEL_EXPIRED (WHEEL_LEVELS * WHEEL_SLOTS) // list index of due timers
+#define WHEEL_TICK_NS (1000000000ull / APIC_TIMER_RATE)
+
+// Level n slots are WHEEL_SLOTS^n ticks wide, a slot is cascaded into the
+// levels below when the level underneath wraps around to it. Cascade
+// boundaries that hold nothing are skipped entirely.
+typedef struct {
+  int lock;
+  uint64_t now; // next tick to process
+  bool expire_queued;
+  uint64_t occupied[WHEEL_LEVELS];
+  soft_timer_t *lists[WHEEL_EXPIRED + 1];
+} timer_wheel_t;
+
+static timer_wheel_t *wheels[MAX_CPU_COUNT];
+
+static void wheel_link(timer_wheel_t *w, soft_timer_t *t, int list) {
+  t->slot = list;
+  t->prev = NULL;
+  t->next = w->lists[list];
+  if (t->next != NULL)
+    t->next->prev = t;
+  w->lists[list] = t;
+
+  if (list < WHEEL_EXPIRED)
+    w->occupied[list / WHEEL_SLOTS] |= 1ull << (list % WHEEL_SLOTS);
+}
+
+static void wheel_unlink(timer_wheel_t *w, soft_timer_t *t) {
+  int list = t->slot;
+  if (t->prev != NULL)
+    t->prev->next = t->next;
+  else
+    w->lists[list] = t->next;
+  if (t->next != NULL)
+    t->next->prev = t->prev;
+
+  if (list < WHEEL_EXPIRED && w->lists[list] == NULL)
+    w->occupied[list / WHEEL_SLOTS] &= ~(1ull << (list % WHEEL_SLOTS));
+
+  t->next = t->prev = NULL;
+}
+
+// Pick the level whose span covers the distance to the deadline, deadlines
+// past the top level are parked there and re-placed when it cascades.
+static void wheel_place(timer_wheel_t *w, soft_timer_t *t) {
+  uint64_t expires = t->expires;
+  if (expires < w->now)
+    expires = t->expires = w->now;
+  if (expires - w->now >= WHEEL_RANGE)
+    expires = w->now + WHEEL_RANGE - 1;
+
+  uint64_t delta = expires - w->now;
+  int lv = 0;
+  while (lv < WHEEL_LEVELS - 1 && (delta >> (WHEEL_BITS * (lv + 1))) != 0)
+    lv++;
+
+  int idx = (expires >> (WHEEL_BITS * lv)) & (WHEEL_SLOTS - 1);
+  wheel_link(w, t, lv * WHEEL_SLOTS + idx);
+}
+
+static void wheel_cascade(timer_wheel_t *w, int lv) {
+  int idx = (w->now >> (WHEEL_BITS * lv)) & (WHEEL_SLOTS - 1);
+  int list = lv * WHEEL_SLOTS + idx;
+
+  soft_timer_t *t = w->lists[list];
+  w->lists[list] = NULL;
+  w->occupied[lv] &= ~(1ull << idx);
+
+  while (t != NULL) {
+    soft_timer_t *next = t->next;
+    wheel_place(w, t);
+    t = next;
+  }
+}
+
+// Round the deadline up within its slack to the tick with the most trailing
+// zeros, so nearby timers share an expiry and sit in the coarsest slot.
+static uint64_t wheel_coalesce(uint64_t expires, uint64_t slack) {
+  uint64_t hi = expires + slack;
+  if (slack == 0 || hi < expires)
+    return expires;
+
+  int bit = 63 - __builtin_clzll(expires ^ hi);
+  return hi & ~((1ull << bit) - 1);
+}
+
+static void wheel_expire(void *arg) {
+  timer_wheel_t *w = arg;
+
+  while (true) {
+    int state = cli();
+    local_spinlock_lock(&w->lock);
+
+    soft_timer_t *t = w->lists[WHEEL_EXPIRED];
+    if (t == NULL) {
+      w->expire_queued = false;
+      local_spinlock_unlock(&w->lock);
+      sti(state);
+      return;
+    }
+
+    wheel_unlink(w, t);
+    t->cpu = -1;
+    SoftTimerHandler func = t->func;
+    void *targ = t->arg;
+
+    local_spinlock_unlock(&w->lock);
+    sti(state);
+
+    func(t, targ);
+  }
+}
+
+void timer_wheel_init(uint64_t now) {
+  int cpu = interrupt_get_cpunum();
+  if (wheels[cpu] != NULL)
+    return;
+
+  timer_wheel_t *w = malloc(sizeof(timer_wheel_t));
+  if (w == NULL)
+    PANIC("Timer wheel allocation failure!");
+  memset(w, 0, sizeof(timer_wheel_t));
+  w->now = now;
+  wheels[cpu] = w;
+}
+
+static uint64_t wheel_next(timer_wheel_t *w) {
+  uint64_t next = TIMER_TICK_NEVER;
+
+  // Level 0 holds exact expiries within the next WHEEL_SLOTS ticks
+  if (w->occupied[0] != 0) {
+    int rot = w->now & (WHEEL_SLOTS - 1);
+    uint64_t bits = (w->occupied[0] >> rot) |
+                    (rot ? w->occupied[0] << (WHEEL_SLOTS - rot) : 0);
+    next = w->now + __builtin_ctzll(bits);
+  }
+
+  // Higher levels only need a wakeup at the boundary that cascades them
+  for (int lv = 1; lv < WHEEL_LEVELS; lv++) {
+    if (w->occupied[lv] == 0)
+      continue;
+
+    int shift = WHEEL_BITS * lv;
+    uint64_t block = (w->now + (1ull << shift) - 1) >> shift;
+    int rot = block & (WHEEL_SLOTS - 1);
+    uint64_t bits = (w->occupied[lv] >> rot) |
+                    (rot ? w->occupied[lv] << (WHEEL_SLOTS - rot) : 0);
+    uint64_t tick = (block + __builtin_ctzll(bits)) << shift;
+    if (tick < next)
+      next = tick;
+  }
+
+  return next;
+}
+
+// Next tick the calling core's wheel has work on, TIMER_TICK_NEVER if empty
+uint64_t timer_wheel_next(void) {
+  timer_wheel_t *w = wheels[interrupt_get_cpunum()];
+  if (w == NULL)
+    return TIMER_TICK_NEVER;
+
+  local_spinlock_lock(&w->lock);
+  uint64_t next = wheel_next(w);
+  // Expired timers that couldn't be deferred (the ring was full) are retried
+  // by timer_wheel_advance, so ask for an interrupt right away
+  if (w->lists[WHEEL_EXPIRED] != NULL && !w->expire_queued)
+    next = w->now;
+  local_spinlock_unlock(&w->lock);
+  return next;
+}
+
+// Process every tick before target, skipping straight over empty stretches.
+// Called from the local timer interrupt.
+void timer_wheel_advance(uint64_t target) {
+  timer_wheel_t *w = wheels[interrupt_get_cpunum()];
+  if (w == NULL)
+    return;
+
+  local_spinlock_lock(&w->lock);
+
+  while (w->now < target) {
+    uint64_t next = wheel_next(w);
+    if (next >= target) {
+      w->now = target;
+      break;
+    }
+    w->now = next;
+
+    for (int lv = 1; lv < WHEEL_LEVELS; lv++) {
+      if ((w->now & ((1ull << (WHEEL_BITS * lv)) - 1)) != 0)
+        break;
+      if (w->occupied[lv] != 0)
+        wheel_cascade(w, lv);
+    }
+
+    int idx = w->now & (WHEEL_SLOTS - 1);
+    if (w->occupied[0] & (1ull << idx)) {
+      soft_timer_t *t = w->lists[idx];
+      w->lists[idx] = NULL;
+      w->occupied[0] &= ~(1ull << idx);
+
+      while (t != NULL) {
+        soft_timer_t *next = t->next;
+        wheel_link(w, t, WHEEL_EXPIRED);
+        t = next;
+      }
+    }
+    w->now++;
+  }
+
+  if (w->lists[WHEEL_EXPIRED] != NULL && !w->expire_queued)
+    w->expire_queued = interrupt_defer(wheel_expire, w) == 0;
+
+  local_spinlock_unlock(&w->lock);
+}
+
+// Lock the wheel t is queued on, NULL if it isn't armed. Returns with
+// interrupts disabled.
+static timer_wheel_t *timer_lockowner(soft_timer_t *t) {
+  while (true) {
+    int cpu = __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE);
+    if (cpu < 0)
+      return NULL;
+
+    timer_wheel_t *w = wheels[cpu];
+    local_spinlock_lock(&w->lock);
+    if (t->cpu == cpu)
+      return w;
+    local_spinlock_unlock(&w->lock);
+  }
+}
+
+void timer_setup(soft_timer_t *t, SoftTimerHandler func, void *arg) {
+  memset(t, 0, sizeof(soft_timer_t));
+  t->cpu = -1;
+  t->func = func;
+  t->arg = arg;
+}
+
+bool timer_cancel(soft_timer_t *t) {
+  int state = cli();
+  timer_wheel_t *w = timer_lockowner(t);
+  if (w == NULL) {
+    sti(state);
+    return false;
+  }
+
+  wheel_unlink(w, t);
+  __atomic_store_n(&t->cpu, -1, __ATOMIC_RELEASE);
+
+  local_spinlock_unlock(&w->lock);
+  sti(state);
+  return true;
+}
+
+void timer_arm(soft_timer_t *t, uint64_t ns, uint64_t slack_ns) {
+  int state = cli();
+
+  timer_wheel_t *w = timer_lockowner(t);
+  if (w != NULL) {
+    wheel_unlink(w, t);
+    __atomic_store_n(&t->cpu, -1, __ATOMIC_RELEASE);
+    local_spinlock_unlock(&w->lock);
+  }
+
+  int cpu = interrupt_get_cpunum();
+  w = wheels[cpu];
+  local_spinlock_lock(&w->lock);
+
+  // The wheel only catches up on interrupts, so measure from the clock
+  uint64_t ticks = (ns + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+  t->expires = wheel_coalesce(apic_timer_now() + ticks, slack_ns / WHEEL_TICK_NS);
+  wheel_place(w, t);
+  __atomic_store_n(&t->cpu, cpu, __ATOMIC_RELEASE);
+  apic_timer_rearm(t->expires);
+
+  local_spinlock_unlock(&w->lock);
+  sti(state);
+}
+
+bool timer_pending(soft_timer_t *t) {
+  return __atomic_load_n(&t->cpu, __ATOMIC_ACQUIRE) >= 0;
+}
+
+#ifdef BENCHMARK
+#define WHEEL_BENCH_ITERS (1000000)
+#define WHEEL_BENCH_TIMERS (1024)
+
+static void wheel_bench_func(soft_timer_t *t, void *arg) {
+  t = NULL;
+  arg = NULL;
+}
+
+static int wheel_bench_distinct(soft_timer_t *timers, int cnt) {
+  int distinct = 0;
+  for (int i = 0; i < cnt; i++) {
+    int j = 0;
+    while (j < i && timers[j].expires != timers[i].expires)
+      j++;
+    if (j == i)
+      distinct++;
+  }
+  return distinct;
+}
+
+// Arm and cancel a million timers spread over every level, then count how
+// many separate expiries a batch collapses to once it is given 10% slack.
+void timer_wheel_benchmark(void) {
+  soft_timer_t *timers = malloc(sizeof(soft_timer_t) * WHEEL_BENCH_TIMERS);
+  for (int i = 0; i < WHEEL_BENCH_TIMERS; i++)
+    timer_setup(&timers[i], wheel_bench_func, NULL);
+
+  uint64_t arm_cycles = 0, cancel_cycles = 0;
+  uint64_t seed = 0x9E3779B97F4A7C15ull;
+  for (int i = 0; i < WHEEL_BENCH_ITERS; i += WHEEL_BENCH_TIMERS) {
+    uint64_t start = rdtsc();
+    for (int j = 0; j < WHEEL_BENCH_TIMERS; j++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 7;
+      seed ^= seed << 17;
+      // 1ms to ~1min
+      timer_arm(&timers[j], 1000000ull << (seed % 16), 0);
+    }
+    uint64_t mid = rdtsc();
+    for (int j = 0; j < WHEEL_BENCH_TIMERS; j++)
+      timer_cancel(&timers[j]);
+    uint64_t end = rdtsc();
+
+    arm_cycles += mid - start;
+    cancel_cycles += end - mid;
+  }
+
+  int iters = (WHEEL_BENCH_ITERS / WHEEL_BENCH_TIMERS) * WHEEL_BENCH_TIMERS;
+  print_str("Timer wheel arm cycles: ");
+  print_uint64(arm_cycles / iters, BASE_HEX);
+  print_str(" cancel cycles: ");
+  print_uint64(cancel_cycles / iters, BASE_HEX);
+  print_str("\r\n");
+
+  for (int s = 0; s < 2; s++) {
+    for (int j = 0; j < WHEEL_BENCH_TIMERS; j++) {
+      uint64_t ns = 10000000ull + j * 50000ull; // 10ms to ~61ms
+      timer_arm(&timers[j], ns, s ? ns / 10 : 0);
+    }
+
+    print_str(s ? "Distinct expiries, 10% slack: " : "Distinct expiries: ");
+    print_int32(wheel_bench_distinct(timers, WHEEL_BENCH_TIMERS), BASE_HEX);
+    print_str("\r\n");
+
+    for (int j = 0; j < WHEEL_BENCH_TIMERS; j++)
+      timer_cancel(&timers[j]);
+  }
+
+  free(timers);
+}
+#endif